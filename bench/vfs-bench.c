@@ -0,0 +1,798 @@
+/*
+ * VFS transport benchmark
+ * Copyright 2012 Audacious development team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Loads transport plugins and drives them through the VFS API with the access
+ * patterns input plugins produce:
+ *
+ * - seq:    sequential 4 KiB reads through the whole file
+ * - getc:   the first 64 KiB read a byte at a time, as tag parsers do
+ * - random: seeks to random offsets, each followed by a 4 KiB read
+ * - tail:   on a fresh handle, the 10-byte ID3v2 header at the start, then the
+ *           128-byte ID3v1 tag and the 32-byte APE footer at the end
+ *
+ * The same generated file is used locally (file://) and through an HTTP/1.1
+ * server running on the loopback interface (http://), which supports
+ * keep-alive and byte ranges.  For each transport, target and pattern, the
+ * throughput, the "io-requests" count reported by the transport (system calls,
+ * GIO operations or HTTP requests) and the median and 99th percentile latency
+ * of a single operation are printed.
+ *
+ * Built on request only:
+ *
+ *     make -C bench
+ *     bench/vfs-bench src/unix-io/unix-io.so src/neon/neon.so
+ *
+ * A transport is only given the targets whose scheme it declares; -a gives it
+ * all of them (GIO can open file:// and http:// URIs as well).  Settings are
+ * taken from the plugins' defaults and can be changed with -o, for example
+ * "-o unix-io:mmap=TRUE".  Only the configuration functions of the plugin API
+ * are provided. */
+
+#define _GNU_SOURCE  /* strcasestr */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <audacious/misc.h>
+#include <audacious/plugin.h>
+#include <libaudcore/vfs.h>
+
+#define BLOCK_SIZE 4096
+#define GETC_BYTES (64 << 10)
+
+typedef struct ConfigItem {
+    char * section, * name, * value;
+    struct ConfigItem * next;
+} ConfigItem;
+
+typedef struct {
+    int64_t * times;    /* nanoseconds per operation */
+    int count, size;
+    int64_t bytes;
+    int64_t requests;   /* -1 if the transport does not count them */
+} Result;
+
+typedef struct {
+    const char * name;
+    void (* run) (const char * uri, Result * result);
+} Pattern;
+
+static ConfigItem * config;
+static bool_t verbose;
+static struct MiscAPI misc_api;
+static AudAPITable api_table = {.misc_api = & misc_api, .verbose = & verbose};
+
+static TransportPlugin * transport;
+static bool_t any_scheme;
+
+static char * data;
+static int64_t data_size = 16 << 20;
+static int rounds = 256;
+static int delay_ms;
+
+/* ---- configuration ---- */
+
+static ConfigItem * config_find (const char * section, const char * name)
+{
+    if (! section)
+        section = "audacious";
+
+    for (ConfigItem * item = config; item; item = item->next)
+    {
+        if (! strcmp (item->section, section) && ! strcmp (item->name, name))
+            return item;
+    }
+
+    return NULL;
+}
+
+static void config_set (const char * section, const char * name,
+ const char * value, bool_t replace)
+{
+    ConfigItem * item = config_find (section, name);
+
+    if (item)
+    {
+        if (replace)
+        {
+            free (item->value);
+            item->value = strdup (value);
+        }
+
+        return;
+    }
+
+    item = malloc (sizeof (ConfigItem));
+    item->section = strdup (section ? section : "audacious");
+    item->name = strdup (name);
+    item->value = strdup (value);
+    item->next = config;
+    config = item;
+}
+
+static void bench_set_defaults (const char * section,
+ const char * const * entries)
+{
+    for (; entries[0] && entries[1]; entries += 2)
+        config_set (section, entries[0], entries[1], FALSE);
+}
+
+static bool_t bench_get_bool (const char * section, const char * name)
+{
+    ConfigItem * item = config_find (section, name);
+    return item && ! strcmp (item->value, "TRUE");
+}
+
+static int bench_get_int (const char * section, const char * name)
+{
+    ConfigItem * item = config_find (section, name);
+    return item ? atoi (item->value) : 0;
+}
+
+static char * bench_get_string (const char * section, const char * name)
+{
+    ConfigItem * item = config_find (section, name);
+    return strdup (item ? item->value : "");
+}
+
+/* "section:name=value" */
+static bool_t parse_setting (const char * arg)
+{
+    const char * colon = strchr (arg, ':');
+    const char * equals = colon ? strchr (colon, '=') : NULL;
+
+    if (! colon || ! equals || colon == arg || equals == colon + 1)
+        return FALSE;
+
+    char section[colon - arg + 1], name[equals - colon];
+
+    snprintf (section, sizeof section, "%s", arg);
+    snprintf (name, sizeof name, "%s", colon + 1);
+
+    config_set (section, name, equals + 1, TRUE);
+    return TRUE;
+}
+
+/* ---- loopback HTTP server ---- */
+
+static bool_t send_all (int fd, const char * buf, int64_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send (fd, buf, len, MSG_NOSIGNAL);
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return FALSE;
+
+        buf += sent;
+        len -= sent;
+    }
+
+    return TRUE;
+}
+
+/* Answers one request; returns FALSE if the connection is to be closed. */
+static bool_t serve_request (int fd, char * request)
+{
+    bool_t head = ! strncmp (request, "HEAD ", 5);
+    bool_t partial = FALSE;
+    int64_t start = 0, end = data_size - 1;
+    char header[512];
+    int len;
+
+    if (strncmp (request, "GET ", 4) && ! head)
+    {
+        len = snprintf (header, sizeof header, "HTTP/1.1 501 Not Implemented\r\n"
+         "Content-Length: 0\r\nConnection: close\r\n\r\n");
+        send_all (fd, header, len);
+        return FALSE;
+    }
+
+    char * range = strcasestr (request, "\r\nRange: bytes=");
+
+    if (range)
+    {
+        char * p = range + 15, * q;
+
+        start = strtoll (p, & q, 10);
+
+        if (q > p && * q == '-')
+        {
+            partial = TRUE;
+
+            if (q[1] >= '0' && q[1] <= '9')
+                end = strtoll (q + 1, NULL, 10);
+            if (end > data_size - 1)
+                end = data_size - 1;
+        }
+    }
+
+    if (delay_ms)
+        usleep (delay_ms * 1000);
+
+    if (partial && (start < 0 || start > end))
+    {
+        len = snprintf (header, sizeof header, "HTTP/1.1 416 Range Not "
+         "Satisfiable\r\nContent-Range: bytes */%" PRId64 "\r\nContent-Length: 0"
+         "\r\nConnection: keep-alive\r\n\r\n", data_size);
+        return send_all (fd, header, len);
+    }
+
+    len = snprintf (header, sizeof header, "HTTP/1.1 %s\r\nContent-Type: "
+     "application/octet-stream\r\nContent-Length: %" PRId64 "\r\n"
+     "Accept-Ranges: bytes\r\n", partial ? "206 Partial Content" : "200 OK",
+     end - start + 1);
+
+    if (partial)
+        len += snprintf (header + len, sizeof header - len, "Content-Range: "
+         "bytes %" PRId64 "-%" PRId64 "/%" PRId64 "\r\n", start, end, data_size);
+
+    len += snprintf (header + len, sizeof header - len, "Connection: "
+     "keep-alive\r\n\r\n");
+
+    if (! send_all (fd, header, len))
+        return FALSE;
+
+    return head || send_all (fd, data + start, end - start + 1);
+}
+
+static void * serve_client (void * arg)
+{
+    int fd = (intptr_t) arg;
+    char buf[8192];
+    int len = 0;
+
+    for (;;)
+    {
+        char * end;
+
+        buf[len] = 0;
+
+        while (! (end = strstr (buf, "\r\n\r\n")))
+        {
+            if (len == sizeof buf - 1)
+                goto DONE;
+
+            int got = recv (fd, buf + len, sizeof buf - 1 - len, 0);
+
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                goto DONE;
+
+            len += got;
+            buf[len] = 0;
+        }
+
+        end[2] = 0;  /* keep the last header line terminated */
+
+        if (! serve_request (fd, buf) || strcasestr (buf, "\r\nConnection: "
+         "close\r\n"))
+            goto DONE;
+
+        int used = end + 4 - buf;
+        memmove (buf, buf + used, len - used);
+        len -= used;
+    }
+
+DONE:
+    close (fd);
+    return NULL;
+}
+
+static void * serve (void * arg)
+{
+    int listener = (intptr_t) arg;
+
+    for (;;)
+    {
+        int fd = accept (listener, NULL, NULL);
+        pthread_t thread;
+
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            fprintf (stderr, "accept: %s\n", strerror (errno));
+            return NULL;
+        }
+
+        if (pthread_create (& thread, NULL, serve_client, (void *) (intptr_t)
+         fd))
+        {
+            close (fd);
+            continue;
+        }
+
+        pthread_detach (thread);
+    }
+}
+
+/* Returns the port, or -1 on error. */
+static int start_server (void)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof addr;
+    pthread_t thread;
+    int listener;
+
+    memset (& addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if ((listener = socket (AF_INET, SOCK_STREAM, 0)) < 0 || bind (listener,
+     (struct sockaddr *) & addr, sizeof addr) < 0 || listen (listener, 16) < 0
+     || getsockname (listener, (struct sockaddr *) & addr, & addr_len) < 0)
+    {
+        fprintf (stderr, "Cannot start HTTP server: %s\n", strerror (errno));
+        return -1;
+    }
+
+    if (pthread_create (& thread, NULL, serve, (void *) (intptr_t) listener))
+    {
+        fprintf (stderr, "Cannot start HTTP server thread.\n");
+        return -1;
+    }
+
+    pthread_detach (thread);
+    return ntohs (addr.sin_port);
+}
+
+/* ---- transports ---- */
+
+static VFSConstructor * lookup_transport (const char * scheme)
+{
+    if (! transport)
+        return NULL;
+    if (any_scheme)
+        return transport->vtable;
+
+    for (const char * const * s = transport->schemes; * s; s ++)
+    {
+        if (! strcmp (* s, scheme))
+            return transport->vtable;
+    }
+
+    return NULL;
+}
+
+static TransportPlugin * load_transport (const char * path)
+{
+    void * module = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+
+    if (! module)
+    {
+        fprintf (stderr, "Cannot load %s: %s\n", path, dlerror ());
+        return NULL;
+    }
+
+    Plugin * (* get_info) (AudAPITable * table) = (Plugin * (*) (AudAPITable
+     *)) dlsym (module, "get_plugin_info");
+    Plugin * header = get_info ? get_info (& api_table) : NULL;
+
+    if (! header || header->magic != _AUD_PLUGIN_MAGIC || header->type !=
+     PLUGIN_TYPE_TRANSPORT)
+    {
+        fprintf (stderr, "%s is not a transport plugin.\n", path);
+        dlclose (module);
+        return NULL;
+    }
+
+    if (header->version != _AUD_PLUGIN_VERSION)
+    {
+        fprintf (stderr, "%s is built for another plugin API version.\n", path);
+        dlclose (module);
+        return NULL;
+    }
+
+    if (header->init && ! header->init ())
+    {
+        fprintf (stderr, "%s failed to initialize.\n", path);
+        dlclose (module);
+        return NULL;
+    }
+
+    /* not closed: plugins may leave threads behind */
+    return (TransportPlugin *) header;
+}
+
+/* ---- access patterns ---- */
+
+static int64_t now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, & ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_time (Result * result, int64_t start)
+{
+    int64_t elapsed = now () - start;
+
+    if (result->count == result->size)
+    {
+        result->size = result->size ? result->size * 2 : 1024;
+        result->times = realloc (result->times, sizeof (int64_t) *
+         result->size);
+    }
+
+    result->times[result->count ++] = elapsed;
+}
+
+static void add_requests (Result * result, VFSFile * file)
+{
+    char * value = vfs_get_metadata (file, "io-requests");
+
+    if (value && result->requests >= 0)
+        result->requests += atoll (value);
+    else
+        result->requests = -1;
+
+    free (value);
+}
+
+/* xorshift, so that every transport gets the same offsets */
+static uint32_t next_random (uint32_t * state)
+{
+    * state ^= * state << 13;
+    * state ^= * state >> 17;
+    * state ^= * state << 5;
+    return * state;
+}
+
+static void run_seq (const char * uri, Result * result)
+{
+    VFSFile * file = vfs_fopen (uri, "r");
+    char buf[BLOCK_SIZE];
+
+    if (! file)
+        return;
+
+    for (;;)
+    {
+        int64_t start = now ();
+        int64_t got = vfs_fread (buf, 1, sizeof buf, file);
+
+        add_time (result, start);
+
+        if (got > 0)
+            result->bytes += got;
+        if (got < sizeof buf)
+            break;
+    }
+
+    add_requests (result, file);
+    vfs_fclose (file);
+}
+
+static void run_getc (const char * uri, Result * result)
+{
+    VFSFile * file = vfs_fopen (uri, "r");
+
+    if (! file)
+        return;
+
+    for (int i = 0; i < GETC_BYTES; i ++)
+    {
+        int64_t start = now ();
+        int c = vfs_getc (file);
+
+        add_time (result, start);
+
+        if (c < 0)
+            break;
+
+        result->bytes ++;
+    }
+
+    add_requests (result, file);
+    vfs_fclose (file);
+}
+
+static void run_random (const char * uri, Result * result)
+{
+    VFSFile * file = vfs_fopen (uri, "r");
+    uint32_t state = 0x2545f491;
+    char buf[BLOCK_SIZE];
+
+    if (! file)
+        return;
+
+    int64_t size = vfs_fsize (file);
+
+    if (size < (int64_t) sizeof buf)
+        size = sizeof buf;
+
+    for (int i = 0; i < rounds; i ++)
+    {
+        int64_t offset = next_random (& state) % (size - sizeof buf + 1);
+        int64_t start = now ();
+        int64_t got = 0;
+
+        if (! vfs_fseek (file, offset, SEEK_SET))
+            got = vfs_fread (buf, 1, sizeof buf, file);
+
+        add_time (result, start);
+
+        if (got > 0)
+            result->bytes += got;
+    }
+
+    add_requests (result, file);
+    vfs_fclose (file);
+}
+
+static void run_tail (const char * uri, Result * result)
+{
+    static const struct {
+        int64_t offset;
+        int whence, size;
+    } probes[] = {
+     {0, SEEK_SET, 10},        /* ID3v2 header */
+     {-128, SEEK_END, 128},    /* ID3v1 tag */
+     {-32, SEEK_END, 32}};     /* APE footer */
+
+    char buf[128];
+
+    for (int i = 0; i < rounds; i ++)
+    {
+        VFSFile * file = vfs_fopen (uri, "r");
+
+        if (! file)
+            return;
+
+        for (int p = 0; p < sizeof probes / sizeof probes[0]; p ++)
+        {
+            int64_t start = now ();
+            int64_t got = 0;
+
+            if (! vfs_fseek (file, probes[p].offset, probes[p].whence))
+                got = vfs_fread (buf, 1, probes[p].size, file);
+
+            add_time (result, start);
+
+            if (got > 0)
+                result->bytes += got;
+        }
+
+        add_requests (result, file);
+        vfs_fclose (file);
+    }
+}
+
+static const Pattern patterns[] = {
+ {"seq", run_seq},
+ {"getc", run_getc},
+ {"random", run_random},
+ {"tail", run_tail}};
+
+/* ---- reporting ---- */
+
+static int compare_times (const void * a, const void * b)
+{
+    int64_t x = * (const int64_t *) a, y = * (const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile (const Result * result, int pct)
+{
+    return result->times[(int64_t) (result->count - 1) * pct / 100] / 1000.0;
+}
+
+static void run_pattern (const char * transport_name, const char * target,
+ const char * uri, const Pattern * pattern)
+{
+    Result result;
+    char requests[32];
+
+    memset (& result, 0, sizeof result);
+
+    int64_t start = now ();
+    pattern->run (uri, & result);
+    int64_t elapsed = now () - start;
+
+    if (! result.count)
+    {
+        printf ("%-10s %-6s %-7s failed\n", transport_name, target,
+         pattern->name);
+        return;
+    }
+
+    qsort (result.times, result.count, sizeof (int64_t), compare_times);
+
+    if (result.requests >= 0)
+        snprintf (requests, sizeof requests, "%" PRId64, result.requests);
+    else
+        snprintf (requests, sizeof requests, "-");
+
+    printf ("%-10s %-6s %-7s %8d %10.1f %9s %10.1f %10.1f\n", transport_name,
+     target, pattern->name, result.count, elapsed > 0 ? result.bytes * 1000.0
+     / elapsed : 0, requests, percentile (& result, 50), percentile (& result,
+     99));
+
+    free (result.times);
+}
+
+/* ---- main ---- */
+
+static char * create_data_file (void)
+{
+    const char * tmp = getenv ("TMPDIR");
+    char path[strlen (tmp ? tmp : "/tmp") + 32];
+    uint32_t state = 0x9e3779b9;
+
+    snprintf (path, sizeof path, "%s/vfs-bench-XXXXXX", tmp ? tmp : "/tmp");
+
+    data = malloc (data_size);
+
+    for (int64_t i = 0; i < data_size; i ++)
+        data[i] = next_random (& state) >> 24;
+
+    int fd = mkstemp (path);
+
+    if (fd < 0)
+    {
+        fprintf (stderr, "Cannot create %s: %s\n", path, strerror (errno));
+        return NULL;
+    }
+
+    if (write (fd, data, data_size) != data_size)
+    {
+        fprintf (stderr, "Cannot write %s: %s\n", path, strerror (errno));
+        close (fd);
+        unlink (path);
+        return NULL;
+    }
+
+    close (fd);
+    return strdup (path);
+}
+
+static void usage (const char * name)
+{
+    fprintf (stderr, "Usage: %s [options] plugin ...\n"
+     "  -a                  give every target to every transport\n"
+     "  -d ms               delay each HTTP response\n"
+     "  -n rounds           seeks and tag probes per pattern (default 256)\n"
+     "  -o section:name=value  change a setting\n"
+     "  -s KiB              size of the test file (default 16384)\n"
+     "  -v                  let plugins print debug messages\n", name);
+}
+
+int main (int argc, char * * argv)
+{
+    int opt;
+
+    while ((opt = getopt (argc, argv, "ad:n:o:s:v")) != -1)
+    {
+        switch (opt)
+        {
+          case 'a':
+            any_scheme = TRUE;
+            break;
+          case 'd':
+            delay_ms = atoi (optarg);
+            break;
+          case 'n':
+            rounds = atoi (optarg);
+            break;
+          case 'o':
+            if (! parse_setting (optarg))
+            {
+                fprintf (stderr, "Invalid setting: %s\n", optarg);
+                return 1;
+            }
+            break;
+          case 's':
+            data_size = (int64_t) atoi (optarg) << 10;
+            break;
+          case 'v':
+            verbose = TRUE;
+            break;
+          default:
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind == argc || rounds < 1 || data_size < BLOCK_SIZE || delay_ms < 0)
+    {
+        usage (argv[0]);
+        return 1;
+    }
+
+    signal (SIGPIPE, SIG_IGN);
+
+    misc_api.config_set_defaults = bench_set_defaults;
+    misc_api.get_bool = bench_get_bool;
+    misc_api.get_int = bench_get_int;
+    misc_api.get_string = bench_get_string;
+
+    char * path = create_data_file ();
+    int port = start_server ();
+
+    if (! path || port < 0)
+        return 1;
+
+    char file_uri[strlen (path) + 8], http_uri[64];
+
+    snprintf (file_uri, sizeof file_uri, "file://%s", path);
+    snprintf (http_uri, sizeof http_uri, "http://127.0.0.1:%d/bench.bin", port);
+
+    const struct {
+        const char * name, * uri;
+    } targets[] = {{"file", file_uri}, {"http", http_uri}};  /* name = scheme */
+
+    vfs_set_lookup_func (lookup_transport);
+
+    printf ("%-10s %-6s %-7s %8s %10s %9s %10s %10s\n", "transport", "target",
+     "pattern", "ops", "MB/s", "requests", "p50 us", "p99 us");
+
+    for (int i = optind; i < argc; i ++)
+    {
+        if (! (transport = load_transport (argv[i])))
+            continue;
+
+        const char * base = strrchr (argv[i], '/') ? strrchr (argv[i], '/') + 1
+         : argv[i];
+        char name[strlen (base) + 1];
+
+        strcpy (name, base);
+
+        if (strchr (name, '.'))
+            * strchr (name, '.') = 0;
+
+        for (int t = 0; t < sizeof targets / sizeof targets[0]; t ++)
+        {
+            if (! lookup_transport (targets[t].name))
+                continue;
+
+            for (int p = 0; p < sizeof patterns / sizeof patterns[0]; p ++)
+                run_pattern (name, targets[t].name, targets[t].uri, & patterns[p]);
+        }
+
+        if (transport->cleanup)
+            transport->cleanup ();
+
+        transport = NULL;
+    }
+
+    unlink (path);
+    free (path);
+    free (data);
+    return 0;
+}
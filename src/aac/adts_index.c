@@ -0,0 +1,187 @@
+/*
+ * ADTS frame index for the AAC decoder plugin
+ * Copyright (C) 2012 Audacious development team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Frame index for raw ADTS files.  Raw AAC has no seek table, so seeking used
+ * to guess a byte offset from the length.  While a file plays from the start,
+ * the offset of every ADTS_INDEX_STEP-th frame is recorded.  Once the end is
+ * reached, the index is stored under the user directory (see index-file.h)
+ * and also gives the exact length of the file.
+ */
+
+#include "../index-file/index-file.h"
+#include "adts_index.h"
+
+#define INDEX_DIR "aac-index"
+#define INDEX_MAGIC "AUDAAIX2"
+#define INDEX_MAX_POINTS (1 << 20)
+
+typedef struct {
+    int64_t frames;
+    int64_t samples;
+    int64_t end;
+    int32_t rate;
+    int32_t count;
+} IndexData;
+
+/* ADTS sync word: twelve set bits, then the ID bit and a zero layer */
+static const unsigned char frame_sync[2] = {0xff, 0xf0};
+static const unsigned char frame_sync_mask[2] = {0xff, 0xf6};
+
+void adts_index_init (AdtsIndex * index, int64_t first_offset)
+{
+    memset (index, 0, sizeof (AdtsIndex));
+    index->next_offset = first_offset;
+}
+
+bool_t adts_index_load (AdtsIndex * index, const char * filename, VFSFile * file)
+{
+    IndexFile f;
+    IndexData data;
+
+    adts_index_init (index, -1);
+
+    if (! index_file_open (& f, INDEX_DIR, INDEX_MAGIC, filename, file))
+        return FALSE;
+
+    if (fread (& data, sizeof data, 1, f.handle) != 1 || data.rate <= 0 ||
+     data.samples <= 0 || data.count <= 0 || data.count > INDEX_MAX_POINTS)
+        goto FAIL;
+
+    index->points = malloc (sizeof (AdtsPoint) * data.count);
+    index->size = data.count;
+
+    if (fread (index->points, sizeof (AdtsPoint), data.count, f.handle) !=
+     data.count)
+        goto FAIL;
+
+    if (! f.local && ! (index_file_has_sync (file, index->points[data.count /
+     2].offset, frame_sync, frame_sync_mask, 2) && index_file_has_sync (file,
+     index->points[data.count - 1].offset, frame_sync, frame_sync_mask, 2)))
+    {
+        AUDDBG ("ADTS index for %s does not match the file.\n", filename);
+        goto FAIL;
+    }
+
+    index_file_close (& f, TRUE);
+
+    index->count = data.count;
+    index->rate = data.rate;
+    index->frames = data.frames;
+    index->next_sample = data.samples;
+    index->next_offset = data.end;
+    index->complete = TRUE;
+
+    AUDDBG ("Loaded ADTS index for %s: %d frames.\n", filename, (int)
+     index->frames);
+    return TRUE;
+
+FAIL:
+    adts_index_free (index);
+    index_file_close (& f, FALSE);
+    return FALSE;
+}
+
+void adts_index_save (const AdtsIndex * index, const char * filename,
+ VFSFile * file)
+{
+    IndexFile f;
+    IndexData data = {index->frames, index->next_sample, index->next_offset,
+     index->rate, index->count};
+
+    if (! index->complete || ! index->count)
+        return;
+
+    if (! index_file_create (& f, INDEX_DIR, INDEX_MAGIC, filename, file))
+        return;
+
+    bool_t ok = (fwrite (& data, sizeof data, 1, f.handle) == 1 && fwrite
+     (index->points, sizeof (AdtsPoint), index->count, f.handle) ==
+     index->count);
+
+    if (index_file_commit (& f, ok))
+        AUDDBG ("Saved ADTS index for %s: %d frames.\n", filename, (int)
+         index->frames);
+}
+
+void adts_index_free (AdtsIndex * index)
+{
+    free (index->points);
+    index->points = NULL;
+    index->count = index->size = 0;
+}
+
+/* Adds the frame at the given offset if it is the one following the last
+ * frame indexed.  Playback may have skipped around, so other frames are
+ * ignored; the index picks up again when playback passes its end. */
+bool_t adts_index_add (AdtsIndex * index, int64_t offset, int length, int rate,
+ int samples)
+{
+    if (index->complete || offset != index->next_offset || length <= 0 ||
+     rate <= 0 || (index->rate && rate != index->rate))
+        return FALSE;
+
+    if (index->frames % ADTS_INDEX_STEP == 0)
+    {
+        if (index->count >= INDEX_MAX_POINTS)
+            return FALSE;
+
+        if (index->count == index->size)
+        {
+            index->size = index->size ? index->size * 2 : 256;
+            index->points = realloc (index->points, sizeof (AdtsPoint) *
+             index->size);
+        }
+
+        index->points[index->count].sample = index->next_sample;
+        index->points[index->count].offset = offset;
+        index->count ++;
+    }
+
+    index->rate = rate;
+    index->frames ++;
+    index->next_sample += samples;
+    index->next_offset = offset + length;
+    return TRUE;
+}
+
+/* Finds the last point at or before the given sample.  Fails if the sample
+ * lies beyond the indexed part of the file. */
+bool_t adts_index_find (const AdtsIndex * index, int64_t sample,
+ int64_t * offset, int64_t * start)
+{
+    if (! index->count || sample < 0 || sample >= index->next_sample)
+        return FALSE;
+
+    int low = 0, high = index->count;
+
+    while (high - low > 1)
+    {
+        int mid = (low + high) / 2;
+
+        if (index->points[mid].sample <= sample)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    * offset = index->points[low].offset;
+    * start = index->points[low].sample;
+    return TRUE;
+}
@@ -0,0 +1,57 @@
+/*
+ * ADTS frame index for the AAC decoder plugin
+ * Copyright (C) 2012 Audacious development team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _AUDMP4_ADTS_INDEX_H
+#define _AUDMP4_ADTS_INDEX_H
+
+#include <stdint.h>
+
+#include <libaudcore/vfs.h>
+
+/* one point every ADTS_INDEX_STEP frames */
+#define ADTS_INDEX_STEP 16
+
+typedef struct {
+    int64_t sample;     /* first sample of the frame, at the ADTS rate */
+    int64_t offset;     /* byte offset of its header */
+} AdtsPoint;
+
+/* Index of an ADTS stream, built from consecutive frames starting with the
+ * first.  next_sample and next_offset describe the frame after the last one
+ * indexed; once the index is complete, next_sample is the exact length. */
+typedef struct {
+    AdtsPoint * points;
+    int count, size;
+    int rate;           /* ADTS sampling rate (without SBR) */
+    int64_t frames;
+    int64_t next_sample, next_offset;
+    bool_t complete;
+} AdtsIndex;
+
+void adts_index_init (AdtsIndex * index, int64_t first_offset);
+bool_t adts_index_load (AdtsIndex * index, const char * filename, VFSFile * file);
+void adts_index_save (const AdtsIndex * index, const char * filename,
+ VFSFile * file);
+void adts_index_free (AdtsIndex * index);
+bool_t adts_index_add (AdtsIndex * index, int64_t offset, int length, int rate,
+ int samples);
+bool_t adts_index_find (const AdtsIndex * index, int64_t sample,
+ int64_t * offset, int64_t * start);
+
+#endif /* _AUDMP4_ADTS_INDEX_H */
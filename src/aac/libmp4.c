@@ -7,6 +7,7 @@
 #include <neaacdec.h>
 
 #include "config.h"
+#include "adts_index.h"
 #include "mp4ff.h"
 #include "tagging.h"
 
@@ -131,7 +132,7 @@ int aac_parse_frame (unsigned char * buf, int *srate, int *num)
     fl =
      ((buf[i + 3] & 0x03) << 11) | (buf[i + 4] << 3) | ((buf[i +
      5] >> 5) & 0x07);
-    *num = (buf[i + 6] & 0x02) + 1;
+    *num = (buf[i + 6] & 0x03) + 1;
 
     return fl;
 }
@@ -351,7 +352,21 @@ static Tuple *aac_get_tuple (const char * filename, VFSFile * handle)
 
     tuple_set_str (tuple, FIELD_CODEC, NULL, "MPEG-2/4 AAC");
 
-    if (!vfs_is_remote (filename))
+    AdtsIndex index;
+
+    /* a complete frame index gives the exact length */
+    if (adts_index_load (&index, filename, handle))
+    {
+        length = index.next_sample * 1000 / index.rate;
+        tuple_set_int (tuple, FIELD_LENGTH, NULL, length);
+
+        if (length > 0)
+            tuple_set_int (tuple, FIELD_BITRATE, NULL, (index.next_offset -
+             index.points[0].offset) * 8 / length);
+
+        adts_index_free (&index);
+    }
+    else if (!vfs_is_remote (filename))
     {
         calc_aac_info (handle, &length, &bitrate, &samplerate, &channels);
 
@@ -652,41 +667,92 @@ static bool_t my_decode_mp4 (InputPlayback * playback, const char * filename,
     return TRUE;
 }
 
-static void aac_seek (VFSFile * file, NeAACDecHandle dec, int time, int len,
- void * buf, int size, int * buflen)
+/* Seeks to the given sample (at the ADTS rate) or, failing that, time.  If the
+ * sample is covered by the frame index, decoding restarts at the frame before
+ * the one containing it, and <start> is set to the first sample of that frame
+ * so that the caller can drop the output up to the target.  Otherwise the byte
+ * offset is estimated from the length and <start> is set to -1.  Returns FALSE
+ * if the position was not changed. */
+static bool_t aac_seek (VFSFile * file, NeAACDecHandle dec,
+ const AdtsIndex * index, int64_t sample, int time, int len, void * buf,
+ int size, int * buflen, int64_t * start)
 {
-    /* == ESTIMATE BYTE OFFSET == */
+    int64_t offset;
+
+    /* == LOOK UP OR ESTIMATE BYTE OFFSET == */
 
-    int64_t total = vfs_fsize (file);
-    if (total < 0)
+    /* a frame holds at most 4 * 1024 samples */
+    bool_t exact = (sample < index->next_sample && adts_index_find (index, MAX
+     (0, sample - 4 * 1024), & offset, start));
+
+    if (! exact)
     {
-        fprintf (stderr, "aac: File is not seekable.\n");
-        return;
+        * start = -1;
+
+        int64_t total = vfs_fsize (file);
+        if (total < 0)
+        {
+            fprintf (stderr, "aac: File is not seekable.\n");
+            return FALSE;
+        }
+
+        if (len <= 0)
+            return FALSE;
+
+        offset = total * time / len;
     }
 
     /* == SEEK == */
 
-    if (vfs_fseek (file, total * time / len, SEEK_SET))
-        return;
+    if (vfs_fseek (file, offset, SEEK_SET))
+        return FALSE;
 
     * buflen = vfs_fread (buf, 1, size, file);
 
-    /* == FIND FRAME HEADER == */
+    int used;
 
-    int used = aac_probe (buf, * buflen);
-
-    if (used == * buflen)
+    if (exact)
     {
-        fprintf (stderr, "aac: No valid frame header found.\n");
-        * buflen = 0;
-        return;
-    }
+        /* == SKIP TO THE FRAME BEFORE THE TARGET == */
 
-    if (used)
+        while (* buflen >= 8)
+        {
+            int rate, blocks, next_blocks;
+
+            used = aac_parse_frame (buf, & rate, & blocks);
+
+            if (used < 8 || used + 8 > * buflen || aac_parse_frame ((unsigned
+             char *) buf + used, & rate, & next_blocks) < 8)
+                break;
+
+            if (* start + 1024 * (blocks + next_blocks) > sample)
+                break;
+
+            * start += 1024 * blocks;
+            * buflen -= used;
+            memmove (buf, (char *) buf + used, * buflen);
+            * buflen += vfs_fread ((char *) buf + * buflen, 1, size - * buflen, file);
+        }
+    }
+    else
     {
-        * buflen -= used;
-        memmove (buf, (char *) buf + used, * buflen);
-        * buflen += vfs_fread ((char *) buf + * buflen, 1, size - * buflen, file);
+        /* == FIND FRAME HEADER == */
+
+        used = aac_probe (buf, * buflen);
+
+        if (used == * buflen)
+        {
+            fprintf (stderr, "aac: No valid frame header found.\n");
+            * buflen = 0;
+            return TRUE;
+        }
+
+        if (used)
+        {
+            * buflen -= used;
+            memmove (buf, (char *) buf + used, * buflen);
+            * buflen += vfs_fread ((char *) buf + * buflen, 1, size - * buflen, file);
+        }
     }
 
     /* == START DECODING == */
@@ -700,6 +766,8 @@ static void aac_seek (VFSFile * file, NeAACDecHandle dec, int time, int len,
         memmove (buf, (char *) buf + used, * buflen);
         * buflen += vfs_fread ((char *) buf + * buflen, 1, size - * buflen, file);
     }
+
+    return TRUE;
 }
 
 static bool_t my_decode_aac (InputPlayback * playback, const char * filename,
@@ -795,6 +863,20 @@ static bool_t my_decode_aac (InputPlayback * playback, const char * filename,
     playback->set_params (playback, bitrate, samplerate, channels);
     playback->set_pb_ready (playback);
 
+    /* == SET UP FRAME INDEX == */
+
+    /* The index is built from consecutive frames starting with this one.
+     * <indexed> tells whether the last frame decoded was added to it, and
+     * <frame_sample> is the first sample of the next frame, at the ADTS rate,
+     * as long as it is known. */
+    AdtsIndex index;
+    bool_t cached = adts_index_load (& index, filename, file);
+    bool_t indexed = FALSE;
+    int64_t frame_sample = 0, seek_sample = -1;
+
+    if (! cached)
+        adts_index_init (& index, vfs_ftell (file) - buflen);
+
     /* == MAIN LOOP == */
 
     while (1)
@@ -814,11 +896,13 @@ static bool_t my_decode_aac (InputPlayback * playback, const char * filename,
         if (seek_value >= 0)
         {
             int length = tuple ? tuple_get_int (tuple, FIELD_LENGTH, NULL) : 0;
+            int64_t sample = (int64_t) seek_value * index.rate / 1000;
 
-            if (length > 0)
+            if (aac_seek (file, decoder, & index, sample, seek_value, length,
+             buf, sizeof buf, & buflen, & frame_sample))
             {
-                aac_seek (file, decoder, seek_value, length, buf, sizeof buf, & buflen);
                 playback->output->flush (seek_value);
+                seek_sample = (frame_sample >= 0) ? sample : -1;
             }
 
             seek_value = -1;
@@ -829,7 +913,12 @@ static bool_t my_decode_aac (InputPlayback * playback, const char * filename,
         /* == CHECK FOR END OF FILE == */
 
         if (! buflen)
+        {
+            if (indexed)
+                index.complete = TRUE;
+
             break;
+        }
 
         /* == CHECK FOR METADATA == */
 
@@ -841,6 +930,12 @@ static bool_t my_decode_aac (InputPlayback * playback, const char * filename,
 
         /* == DECODE A FRAME == */
 
+        int64_t frame_offset = vfs_ftell (file) - buflen;
+        int frame_len = 0, frame_rate = 0, frame_blocks = 0;
+
+        if (buflen >= 8)
+            frame_len = aac_parse_frame (buf, & frame_rate, & frame_blocks);
+
         NeAACDecFrameInfo info;
         void * audio = NeAACDecDecode (decoder, & info, buf, buflen);
 
@@ -848,6 +943,13 @@ static bool_t my_decode_aac (InputPlayback * playback, const char * filename,
         {
             fprintf (stderr, "aac: %s.\n", NeAACDecGetErrorMessage (info.error));
 
+            /* a broken frame ends the index; stray bytes (such as a trailing
+             * tag) do not */
+            if (frame_len >= 8)
+                indexed = FALSE;
+
+            frame_sample = seek_sample = -1;
+
             if (buflen)
             {
                 used = 1 + aac_probe (buf + 1, buflen - 1);
@@ -866,16 +968,56 @@ static bool_t my_decode_aac (InputPlayback * playback, const char * filename,
             buflen += vfs_fread (buf + buflen, 1, sizeof buf - buflen, file);
         }
 
+        /* == UPDATE FRAME INDEX == */
+
+        int64_t this_sample = frame_sample;
+
+        if (frame_len >= 8 && used == frame_len)
+        {
+            if (! cached)
+                indexed = adts_index_add (& index, frame_offset, frame_len,
+                 frame_rate, 1024 * frame_blocks);
+
+            if (frame_sample >= 0)
+                frame_sample += 1024 * frame_blocks;
+        }
+        else
+        {
+            indexed = FALSE;
+            frame_sample = seek_sample = -1;
+        }
+
+        /* == DROP OUTPUT BEFORE THE SEEK TARGET == */
+
+        int skip = 0;
+
+        if (seek_sample > this_sample && this_sample >= 0 && frame_rate > 0 &&
+         info.channels)
+        {
+            int frames = info.samples / info.channels;
+
+            skip = (seek_sample - this_sample) * info.samplerate / frame_rate;
+            skip = MIN (skip, frames) * info.channels;
+
+            if (frame_sample >= seek_sample)
+                seek_sample = -1;
+        }
+
         /* == PLAY THE SOUND == */
 
-        if (audio && info.samples)
-            playback->output->write_audio (audio, sizeof (float) * info.samples);
+        if (audio && info.samples > skip)
+            playback->output->write_audio ((float *) audio + skip, sizeof
+             (float) * (info.samples - skip));
     }
 
     pthread_mutex_lock (& mutex);
     stop_flag = TRUE;
     pthread_mutex_unlock (& mutex);
 
+    if (! cached)
+        adts_index_save (& index, filename, file);
+
+    adts_index_free (& index);
     NeAACDecClose (decoder);
 
     if (tuple)
@@ -0,0 +1,130 @@
+/*
+ * Sample format conversion for the FFaudio plugin
+ * Copyright 2012 Audacious development team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Planar to interleaved conversion.  Decoders such as AAC, Vorbis, WMA and
+ * Opus hand out one plane per channel; the output plugins want interleaved
+ * samples.  Stereo, by far the common case, gets SSE2 (or AVX) kernels when
+ * the compiler targets them; everything else uses the plain loops. */
+
+#include <glib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "ffaudio-stdinc.h"
+
+static void interleave_stereo_32 (const guint32 * left, const guint32 * right,
+ guint32 * out, gint samples)
+{
+    gint i = 0;
+
+#ifdef __AVX__
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m256 l = _mm256_loadu_ps ((const float *) left + i);
+        __m256 r = _mm256_loadu_ps ((const float *) right + i);
+        __m256 lo = _mm256_unpacklo_ps (l, r);  /* l0 r0 l1 r1 | l4 r4 l5 r5 */
+        __m256 hi = _mm256_unpackhi_ps (l, r);  /* l2 r2 l3 r3 | l6 r6 l7 r7 */
+        _mm256_storeu_ps ((float *) out + 2 * i, _mm256_permute2f128_ps (lo, hi, 0x20));
+        _mm256_storeu_ps ((float *) out + 2 * i + 8, _mm256_permute2f128_ps (lo, hi, 0x31));
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 4 <= samples; i += 4)
+    {
+        __m128i l = _mm_loadu_si128 ((const __m128i *) (left + i));
+        __m128i r = _mm_loadu_si128 ((const __m128i *) (right + i));
+        _mm_storeu_si128 ((__m128i *) (out + 2 * i), _mm_unpacklo_epi32 (l, r));
+        _mm_storeu_si128 ((__m128i *) (out + 2 * i + 4), _mm_unpackhi_epi32 (l, r));
+    }
+#endif
+
+    for (; i < samples; i ++)
+    {
+        out[2 * i] = left[i];
+        out[2 * i + 1] = right[i];
+    }
+}
+
+static void interleave_stereo_16 (const guint16 * left, const guint16 * right,
+ guint16 * out, gint samples)
+{
+    gint i = 0;
+
+#ifdef __SSE2__
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m128i l = _mm_loadu_si128 ((const __m128i *) (left + i));
+        __m128i r = _mm_loadu_si128 ((const __m128i *) (right + i));
+        _mm_storeu_si128 ((__m128i *) (out + 2 * i), _mm_unpacklo_epi16 (l, r));
+        _mm_storeu_si128 ((__m128i *) (out + 2 * i + 8), _mm_unpackhi_epi16 (l, r));
+    }
+#endif
+
+    for (; i < samples; i ++)
+    {
+        out[2 * i] = left[i];
+        out[2 * i + 1] = right[i];
+    }
+}
+
+#define INTERLEAVE_GENERIC(type) \
+{ \
+    type * out = (type *) dest; \
+    for (gint ch = 0; ch < channels; ch ++) \
+    { \
+        const type * in = (const type *) planes[ch]; \
+        type * set = out + ch; \
+        for (gint i = 0; i < samples; i ++, set += channels) \
+            * set = in[i]; \
+    } \
+}
+
+/* Returns the number of bytes written to dest, which must hold
+ * channels * samples * bytes_per_sample. */
+gint convert_planar (guint8 * const * planes, gint channels, gint samples,
+ gint bytes_per_sample, void * dest)
+{
+    if (channels == 1)
+        memcpy (dest, planes[0], bytes_per_sample * samples);
+    else if (channels == 2 && bytes_per_sample == 4)
+        interleave_stereo_32 ((const guint32 *) planes[0], (const guint32 *)
+         planes[1], dest, samples);
+    else if (channels == 2 && bytes_per_sample == 2)
+        interleave_stereo_16 ((const guint16 *) planes[0], (const guint16 *)
+         planes[1], dest, samples);
+    else
+    {
+        switch (bytes_per_sample)
+        {
+        case 1: INTERLEAVE_GENERIC (guint8) break;
+        case 2: INTERLEAVE_GENERIC (guint16) break;
+        case 4: INTERLEAVE_GENERIC (guint32) break;
+        case 8: INTERLEAVE_GENERIC (guint64) break;
+        default: return 0;
+        }
+    }
+
+    return bytes_per_sample * channels * samples;
+}
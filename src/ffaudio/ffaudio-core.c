@@ -26,6 +26,7 @@
 
 #include <glib.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #undef FFAUDIO_DOUBLECHECK  /* Doublecheck probing result for debugging purposes */
 #undef FFAUDIO_NO_BLACKLIST /* Don't blacklist any recognized codecs/formats */
@@ -35,6 +36,8 @@
 #include <audacious/i18n.h>
 #include <audacious/debug.h>
 #include <audacious/audtag.h>
+#include <audacious/misc.h>
+#include <audacious/preferences.h>
 #include <libaudcore/audstrings.h>
 
 static pthread_mutex_t ctrl_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -73,8 +76,14 @@ static gint lockmgr (void * * mutexp, enum AVLockOp op)
     return 0;
 }
 
+static const gchar * const ffaudio_defaults[] = {
+ "decode_threads", "0",  /* 0 = automatic */
+ NULL};
+
 static gboolean ffaudio_init (void)
 {
+    aud_config_set_defaults ("ffaudio", ffaudio_defaults);
+
     av_register_all();
     av_lockmgr_register (lockmgr);
 
@@ -265,6 +274,62 @@ ffaudio_codec_is_seekable(AVCodec *codec)
     }
 }
 
+/* Codecs that are slow enough to run near realtime on low-clock CPUs. */
+static gboolean ffaudio_codec_is_heavy (AVCodecContext * c)
+{
+    switch (c->codec_id)
+    {
+        case CODEC_ID_APE:
+        case CODEC_ID_WMALOSSLESS:
+        case CODEC_ID_TRUEHD:
+        case CODEC_ID_MLP:
+        case CODEC_ID_DTS:
+            return TRUE;
+        case CODEC_ID_FLAC:
+        case CODEC_ID_ALAC:
+        case CODEC_ID_WAVPACK:
+        case CODEC_ID_TTA:
+            /* lossless, heavy only with hi-res or multichannel content */
+            return (c->sample_rate * c->channels > 96000 * 2);
+        default:
+            /* lossy codecs are cheap enough even in 5.1 */
+            return (c->sample_rate > 96000);
+    }
+}
+
+/* Sets up frame or slice threading, if the decoder supports either.  The
+ * decode_threads setting overrides the automatic choice; 1 disables
+ * threading. */
+static void ffaudio_setup_threads (AVCodecContext * c, AVCodec * codec)
+{
+    gint type = 0;
+
+#ifdef CODEC_CAP_FRAME_THREADS
+    if (codec->capabilities & CODEC_CAP_FRAME_THREADS)
+        type |= FF_THREAD_FRAME;
+#endif
+#ifdef CODEC_CAP_SLICE_THREADS
+    if (codec->capabilities & CODEC_CAP_SLICE_THREADS)
+        type |= FF_THREAD_SLICE;
+#endif
+
+    if (! type)
+        return;
+
+    gint threads = aud_get_int ("ffaudio", "decode_threads");
+
+    if (threads <= 0)
+    {
+        if (! ffaudio_codec_is_heavy (c))
+            return;
+
+        threads = CLAMP (sysconf (_SC_NPROCESSORS_ONLN), 1, 4);
+    }
+
+    c->thread_count = MIN (threads, 16);
+    c->thread_type = type;
+}
+
 static gboolean ffaudio_probe (const gchar * filename, VFSFile * file)
 {
     if (! file)
@@ -399,6 +464,179 @@ static gboolean ffaudio_write_tag (const Tuple * tuple, VFSFile * file)
     return tag_tuple_write(tuple, file, TAG_TYPE_NONE);
 }
 
+/* Packet queue between the demuxer thread and the playback (decoder) thread,
+ * so that slow reads from the transport do not stall decoding and vice
+ * versa.  It holds up to QUEUE_MS of audio, or QUEUE_MAX_PACKETS packets for
+ * formats that do not give packet durations. */
+
+#define QUEUE_MS 1000
+#define QUEUE_MAX_PACKETS 256
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    AVFormatContext * ic;
+    gint stream_id;
+    GQueue packets;
+    gint64 duration, max_duration;  /* in stream time base */
+    gboolean busy;         /* demuxer is inside av_read_frame */
+    gboolean paused;       /* seek in progress */
+    gboolean eof;
+    gboolean interrupted;  /* stop or seek requested */
+    gboolean quit;
+} PacketQueue;
+
+static PacketQueue * queue = NULL;  /* protected by ctrl_mutex */
+
+static gboolean queue_full (PacketQueue * q)
+{
+    if (q->duration > 0)
+        return q->duration >= q->max_duration;
+
+    return g_queue_get_length (& q->packets) >= QUEUE_MAX_PACKETS;
+}
+
+static void queue_clear (PacketQueue * q)
+{
+    AVPacket * pkt;
+
+    while ((pkt = g_queue_pop_head (& q->packets)))
+    {
+        av_free_packet (pkt);
+        g_slice_free (AVPacket, pkt);
+    }
+
+    q->duration = 0;
+}
+
+static void * demux_worker (void * arg)
+{
+    PacketQueue * q = arg;
+    gint errcount = 0;
+
+    pthread_mutex_lock (& q->mutex);
+
+    while (1)
+    {
+        if (! q->quit && (q->paused || q->eof || queue_full (q)))
+        {
+            pthread_cond_wait (& q->cond, & q->mutex);
+            continue;
+        }
+
+        if (q->quit)
+            break;
+
+        AVPacket pkt;
+        gint ret;
+
+        q->busy = TRUE;
+        pthread_mutex_unlock (& q->mutex);
+
+        if ((ret = av_read_frame (q->ic, & pkt)) >= 0 && pkt.stream_index ==
+         q->stream_id)
+            av_dup_packet (& pkt);  /* may point into demuxer memory */
+
+        pthread_mutex_lock (& q->mutex);
+        q->busy = FALSE;
+
+        if (ret < 0)
+        {
+            if (q->paused)
+                ;  /* seek pending; the read is stale anyway */
+            else if (ret == AVERROR_EOF)
+            {
+                AUDDBG("eof reached\n");
+                q->eof = TRUE;
+            }
+            else if (++errcount > 4)
+            {
+                _ERROR("av_read_frame error %d, giving up.\n", ret);
+                q->eof = TRUE;
+            }
+        }
+        else
+        {
+            errcount = 0;
+
+            /* Ignore any other substreams */
+            if (q->paused || pkt.stream_index != q->stream_id)
+                av_free_packet (& pkt);
+            else
+            {
+                g_queue_push_tail (& q->packets, g_slice_dup (AVPacket, & pkt));
+                q->duration += pkt.duration;
+            }
+        }
+
+        pthread_cond_broadcast (& q->cond);
+    }
+
+    pthread_mutex_unlock (& q->mutex);
+    return NULL;
+}
+
+/* Returns 1 if a packet was taken, 0 if interrupted by stop or seek, or -1 at
+ * end of stream. */
+static gint queue_pop (PacketQueue * q, AVPacket * pkt)
+{
+    AVPacket * head;
+    gint ret;
+
+    pthread_mutex_lock (& q->mutex);
+
+    while (! (head = g_queue_pop_head (& q->packets)) && ! q->eof && !
+     q->interrupted)
+        pthread_cond_wait (& q->cond, & q->mutex);
+
+    if (head)
+    {
+        * pkt = * head;
+        g_slice_free (AVPacket, head);
+        q->duration -= pkt->duration;
+        pthread_cond_broadcast (& q->cond);
+        ret = 1;
+    }
+    else
+        ret = q->interrupted ? 0 : -1;
+
+    q->interrupted = FALSE;
+
+    pthread_mutex_unlock (& q->mutex);
+    return ret;
+}
+
+/* Called with ctrl_mutex held. */
+static void queue_interrupt (PacketQueue * q)
+{
+    pthread_mutex_lock (& q->mutex);
+    q->interrupted = TRUE;
+    pthread_cond_broadcast (& q->cond);
+    pthread_mutex_unlock (& q->mutex);
+}
+
+/* Parks the demuxer, seeks and drops everything queued before the seek. */
+static gint queue_seek (PacketQueue * q, gint64 time)
+{
+    pthread_mutex_lock (& q->mutex);
+
+    q->paused = TRUE;
+    while (q->busy)
+        pthread_cond_wait (& q->cond, & q->mutex);
+
+    gint ret = av_seek_frame (q->ic, -1, time * AV_TIME_BASE / 1000,
+     AVSEEK_FLAG_ANY);
+
+    queue_clear (q);
+    q->eof = FALSE;
+    q->paused = FALSE;
+
+    pthread_cond_broadcast (& q->cond);
+    pthread_mutex_unlock (& q->mutex);
+
+    return ret;
+}
+
 static gboolean ffaudio_play (InputPlayback * playback, const gchar * filename,
  VFSFile * file, gint start_time, gint stop_time, gboolean pause)
 {
@@ -410,11 +648,19 @@ static gboolean ffaudio_play (InputPlayback * playback, const gchar * filename,
     AVCodecContext *c = NULL;
     AVStream *s = NULL;
     AVPacket pkt = {.data = NULL};
-    gint i, stream_id, errcount;
+    AVFrame * frame = NULL;
+    PacketQueue q = {.ic = NULL};
+    pthread_t demux_thread;
+    gint i, stream_id;
     gboolean codec_opened = FALSE;
     gint out_fmt;
+    gboolean planar;
     gboolean seekable;
+    gint64 decode_time = 0, decode_samples = 0;
+    gboolean draining = FALSE, drained = FALSE;
     gboolean error = FALSE;
+    guint8 * buf = NULL;
+    gint buf_size = 0;
 
     AVFormatContext * ic = open_input_file (filename, file);
     if (! ic)
@@ -442,21 +688,34 @@ static gboolean ffaudio_play (InputPlayback * playback, const gchar * filename,
 
     AUDDBG("got codec %s for stream index %d, opening\n", codec->name, stream_id);
 
+    ffaudio_setup_threads (c, codec);
+
     if (avcodec_open2 (c, codec, NULL) < 0)
         goto error_exit;
 
     codec_opened = TRUE;
 
+    AUDDBG ("decoding with %d thread(s), type %d\n", c->thread_count,
+     c->active_thread_type);
+
+    /* the output gets the codec's own sample format; planar formats are
+     * interleaved by convert_planar() */
     switch (c->sample_fmt) {
-        case AV_SAMPLE_FMT_U8: out_fmt = FMT_U8; break;
-        case AV_SAMPLE_FMT_S16: out_fmt = FMT_S16_NE; break;
-        case AV_SAMPLE_FMT_S32: out_fmt = FMT_S32_NE; break;
-        case AV_SAMPLE_FMT_FLT: out_fmt = FMT_FLOAT; break;
+        case AV_SAMPLE_FMT_U8: case AV_SAMPLE_FMT_U8P: out_fmt = FMT_U8; break;
+        case AV_SAMPLE_FMT_S16: case AV_SAMPLE_FMT_S16P: out_fmt = FMT_S16_NE; break;
+        case AV_SAMPLE_FMT_S32: case AV_SAMPLE_FMT_S32P: out_fmt = FMT_S32_NE; break;
+        case AV_SAMPLE_FMT_FLT: case AV_SAMPLE_FMT_FLTP: out_fmt = FMT_FLOAT; break;
     default:
         fprintf (stderr, "ffaudio: Unsupported audio format %d\n", (int) c->sample_fmt);
         goto error_exit;
     }
 
+    planar = av_sample_fmt_is_planar (c->sample_fmt);
+    AUDDBG ("sample format %s%s\n", av_get_sample_fmt_name (c->sample_fmt),
+     planar ? " (planar)" : "");
+
+    frame = avcodec_alloc_frame ();
+
     /* Open audio output */
     AUDDBG("opening audio output\n");
 
@@ -480,9 +739,17 @@ static gboolean ffaudio_play (InputPlayback * playback, const gchar * filename,
     stop_flag = FALSE;
     seek_value = (start_time > 0) ? start_time : -1;
     playback->set_pb_ready(playback);
-    errcount = 0;
     seekable = ffaudio_codec_is_seekable(codec);
 
+    pthread_mutex_init (& q.mutex, NULL);
+    pthread_cond_init (& q.cond, NULL);
+    q.ic = ic;
+    q.stream_id = stream_id;
+    q.max_duration = av_rescale_q (QUEUE_MS, (AVRational) {1, 1000},
+     ic->streams[stream_id]->time_base);
+    pthread_create (& demux_thread, NULL, demux_worker, & q);
+    queue = & q;
+
     pthread_mutex_unlock (& ctrl_mutex);
 
     while (!stop_flag && (stop_time < 0 ||
@@ -496,46 +763,36 @@ static gboolean ffaudio_play (InputPlayback * playback, const gchar * filename,
         if (seek_value >= 0 && seekable)
         {
             playback->output->flush (seek_value);
-            if (av_seek_frame (ic, -1, (gint64) seek_value * AV_TIME_BASE /
-             1000, AVSEEK_FLAG_ANY) < 0)
-            {
+            if (queue_seek (& q, seek_value) < 0)
                 _ERROR("error while seeking\n");
-            } else
-                errcount = 0;
+
+            avcodec_flush_buffers (c);
+            draining = FALSE;
         }
         seek_value = -1;
         pthread_mutex_unlock (& ctrl_mutex);
 
-        /* Read next frame (or more) of data */
-        if ((ret = av_read_frame(ic, &pkt)) < 0)
+        /* Next packet from the demuxer thread.  At the end of the stream,
+         * empty packets are fed to the decoder until it returns no more
+         * frames; with frame threading it holds back up to thread_count - 1
+         * of them. */
+        if (! draining)
         {
-            if (ret == AVERROR_EOF)
-            {
-                AUDDBG("eof reached\n");
-                break;
-            }
-            else
+            if (! (ret = queue_pop (& q, & pkt)))
+                continue;
+
+            if (ret < 0)
             {
-                if (++errcount > 4)
-                {
-                    _ERROR("av_read_frame error %d, giving up.\n", ret);
-                    break;
-                } else
-                    continue;
+                av_init_packet (& pkt);
+                pkt.data = NULL;
+                pkt.size = 0;
+                draining = TRUE;
             }
-        } else
-            errcount = 0;
-
-        /* Ignore any other substreams */
-        if (pkt.stream_index != stream_id)
-        {
-            av_free_packet(&pkt);
-            continue;
         }
 
         /* Decode and play packet/frame */
         memcpy(&tmp, &pkt, sizeof(tmp));
-        while (tmp.size > 0 && !stop_flag)
+        while ((tmp.size > 0 || draining) && !stop_flag)
         {
             /* Check for seek request and bail out if we have one */
             pthread_mutex_lock (& ctrl_mutex);
@@ -551,13 +808,17 @@ static gboolean ffaudio_play (InputPlayback * playback, const gchar * filename,
             }
             pthread_mutex_unlock (& ctrl_mutex);
 
-            AVFrame * frame = avcodec_alloc_frame ();
             int decoded = 0;
+            avcodec_get_frame_defaults (frame);
+
+            gint64 decode_start = g_get_monotonic_time ();
             int len = avcodec_decode_audio4 (c, frame, & decoded, & tmp);
+            decode_time += g_get_monotonic_time () - decode_start;
 
             if (len < 0)
             {
                 fprintf (stderr, "ffaudio: decode_audio() failed, code %d\n", len);
+                drained = draining;
                 break;
             }
 
@@ -565,25 +826,74 @@ static gboolean ffaudio_play (InputPlayback * playback, const gchar * filename,
             tmp.data += len;
 
             if (! decoded)
+            {
+                if (draining)
+                {
+                    drained = TRUE;
+                    break;
+                }
+
                 continue;
+            }
+
+            decode_samples += frame->nb_samples;
 
-            playback->output->write_audio (frame->data[0], FMT_SIZEOF (out_fmt)
-             * c->channels * frame->nb_samples);
-            av_free (frame);
+            gint size = FMT_SIZEOF (out_fmt) * c->channels * frame->nb_samples;
+
+            if (planar)
+            {
+                if (size > buf_size)
+                    buf = g_realloc (buf, buf_size = size);
+
+                convert_planar (frame->extended_data, c->channels,
+                 frame->nb_samples, FMT_SIZEOF (out_fmt), buf);
+                playback->output->write_audio (buf, size);
+            }
+            else
+                playback->output->write_audio (frame->data[0], size);
         }
 
         if (pkt.data)
             av_free_packet(&pkt);
+
+        if (drained)
+            break;
     }
 
 error_exit:
 
     AUDDBG("decode loop finished, shutting down\n");
 
+    if (decode_time > 0 && c->sample_rate > 0)
+        AUDDBG ("decoded %d ms of audio in %d ms (%.1fx realtime)\n",
+         (gint) (decode_samples * 1000 / c->sample_rate), (gint) (decode_time /
+         1000), (gdouble) decode_samples * 1000000 / c->sample_rate /
+         decode_time);
+
+    pthread_mutex_lock (& ctrl_mutex);
     stop_flag = TRUE;
+    queue = NULL;
+    pthread_mutex_unlock (& ctrl_mutex);
+
+    if (q.ic)
+    {
+        pthread_mutex_lock (& q.mutex);
+        q.quit = TRUE;
+        pthread_cond_broadcast (& q.cond);
+        pthread_mutex_unlock (& q.mutex);
+
+        pthread_join (demux_thread, NULL);
+        queue_clear (& q);
+
+        pthread_cond_destroy (& q.cond);
+        pthread_mutex_destroy (& q.mutex);
+    }
 
     if (pkt.data)
         av_free_packet(&pkt);
+    if (frame)
+        av_free (frame);
+    g_free (buf);
     if (codec_opened)
         avcodec_close(c);
     if (ic != NULL)
@@ -601,6 +911,9 @@ static void ffaudio_stop(InputPlayback * playback)
     {
         stop_flag = TRUE;
         playback->output->abort_write();
+
+        if (queue)
+            queue_interrupt (queue);
     }
 
     pthread_mutex_unlock (& ctrl_mutex);
@@ -624,6 +937,9 @@ static void ffaudio_seek (InputPlayback * playback, gint time)
     {
         seek_value = time;
         playback->output->abort_write();
+
+        if (queue)
+            queue_interrupt (queue);
     }
 
     pthread_mutex_unlock (& ctrl_mutex);
@@ -637,6 +953,16 @@ static const char ffaudio_about[] =
     "William Pitcock <nenolod@nenolod.net>\n"
     "Matti Hämäläinen <ccr@tnsp.org>");
 
+static const PreferencesWidget ffaudio_widgets[] = {
+ {WIDGET_LABEL, N_("<b>Decoding</b>")},
+ {WIDGET_SPIN_BTN, N_("Decoder threads:"),
+  .cfg_type = VALUE_INT, .csect = "ffaudio", .cname = "decode_threads",
+  .data = {.spin_btn = {0, 16, 1, N_("(0 = automatic)")}}}};
+
+static const PluginPreferences ffaudio_prefs = {
+ .widgets = ffaudio_widgets,
+ .n_widgets = sizeof ffaudio_widgets / sizeof ffaudio_widgets[0]};
+
 static const gchar *ffaudio_fmts[] = {
     /* musepack, SV7/SV8 */
     "mpc", "mp+", "mpp",
@@ -680,6 +1006,7 @@ AUD_INPUT_PLUGIN
     .name = N_("FFmpeg Plugin"),
     .domain = PACKAGE,
     .about_text = ffaudio_about,
+    .prefs = & ffaudio_prefs,
     .init = ffaudio_init,
     .cleanup = ffaudio_cleanup,
     .is_our_file_from_vfs = ffaudio_probe,
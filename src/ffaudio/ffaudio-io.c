@@ -17,18 +17,42 @@
  */
 
 #include <glib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <audacious/debug.h>
 
 #include "ffaudio-stdinc.h"
 
-#define IOBUF 4096
+/* Buffer sizes.  Remote files pay per request, so they get a large buffer.
+ * Live streams keep a small one, since a read blocks until the buffer is full
+ * and a low bitrate stream would take seconds to start.  Local files get a few
+ * pages: libavformat reads anything larger than the buffer straight into the
+ * caller's memory, so big packets skip the copy while header parsing still
+ * reads from the buffer. */
+#define IOBUF_LOCAL_PAGES 8
+#define IOBUF_REMOTE 65536
+#define IOBUF_STREAM 4096
+
+typedef struct {
+    VFSFile * file;
+    gint64 reads, bytes;
+} IOHandle;
 
-static gint read_cb (void * file, guchar * buf, gint size)
+static gint read_cb (void * opaque, guchar * buf, gint size)
 {
-    return vfs_fread (buf, 1, size, file);
+    IOHandle * h = opaque;
+    gint64 len = vfs_fread (buf, 1, size, h->file);
+
+    h->reads ++;
+    h->bytes += MAX (len, 0);
+    return len;
 }
 
-static gint64 seek_cb (void * file, gint64 offset, gint whence)
+static gint64 seek_cb (void * opaque, gint64 offset, gint whence)
 {
+    VFSFile * file = ((IOHandle *) opaque)->file;
+
     if (whence == AVSEEK_SIZE)
         return vfs_fsize (file);
     if (vfs_fseek (file, offset, whence & ~(gint) AVSEEK_FORCE))
@@ -36,14 +60,39 @@ static gint64 seek_cb (void * file, gint64 offset, gint whence)
     return vfs_ftell (file);
 }
 
+static gint io_buffer_size (VFSFile * file)
+{
+    const gchar * name = vfs_get_filename (file);
+
+    if (vfs_is_streaming (file))
+        return IOBUF_STREAM;
+    if (name && strncmp (name, "file://", 7))
+        return IOBUF_REMOTE;
+
+    glong page = sysconf (_SC_PAGESIZE);
+    return (page > 0 ? page : 4096) * IOBUF_LOCAL_PAGES;
+}
+
 AVIOContext * io_context_new (VFSFile * file)
 {
-    guchar * buf = av_malloc (IOBUF);
-    return avio_alloc_context (buf, IOBUF, 0, file, read_cb, NULL, seek_cb);
+    IOHandle * h = g_slice_new0 (IOHandle);
+    gint size = io_buffer_size (file);
+    guchar * buf = av_malloc (size);
+
+    h->file = file;
+    AUDDBG ("AVIO buffer size %d for %s\n", size, vfs_get_filename (file));
+
+    return avio_alloc_context (buf, size, 0, h, read_cb, NULL, seek_cb);
 }
 
 void io_context_free (AVIOContext * io)
 {
+    IOHandle * h = io->opaque;
+
+    AUDDBG ("AVIO: %" G_GINT64_FORMAT " reads, %" G_GINT64_FORMAT " bytes\n",
+     h->reads, h->bytes);
+
+    g_slice_free (IOHandle, h);
     av_free (io->buffer);
     av_free (io);
 }
@@ -33,4 +33,7 @@
 AVIOContext * io_context_new (VFSFile * file);
 void io_context_free (AVIOContext * context);
 
+gint convert_planar (guint8 * const * planes, gint channels, gint samples,
+ gint bytes_per_sample, void * dest);
+
 #endif
@@ -46,8 +46,23 @@ typedef struct callback_info {
     unsigned buffer_used;
     VFSFile* fd;
     int bitrate;
+    bool_t float_output;    /* output_buffer holds floats instead of int32_t */
+    FLAC__uint64 frame_sample;  /* first sample of the last decoded frame */
+    bool_t has_seektable;
 } callback_info;
 
+typedef struct {
+    int64_t sample;
+    int64_t offset;
+} SeekPoint;
+
+typedef struct {
+    SeekPoint * points;     /* sorted by sample */
+    int count, size;
+    int64_t step;
+    bool_t changed;
+} SeekPoints;
+
 /* metadata.c */
 bool_t flac_update_song_tuple(const Tuple *tuple, VFSFile *fd);
 bool_t flac_get_image(const char *filename, VFSFile *fd, void **data, int64_t *length);
@@ -69,4 +84,22 @@ void clean_callback_info(callback_info* info);
 void reset_info(callback_info* info);
 bool_t read_metadata(FLAC__StreamDecoder* decoder, callback_info* info);
 
+/* parallel.c */
+typedef struct ParallelDecoder ParallelDecoder;
+ParallelDecoder * parallel_new (VFSFile * file, const callback_info * main);
+void parallel_free (ParallelDecoder * pd);
+bool_t parallel_reset (ParallelDecoder * pd, int64_t offset);
+int parallel_next (ParallelDecoder * pd, int32_t * * out, unsigned * used,
+ int64_t * offset, int64_t * sample);
+void parallel_release (ParallelDecoder * pd);
+
+/* seekpoints.c */
+void seek_points_load (SeekPoints * sp, const char * filename, VFSFile * file,
+ unsigned sample_rate);
+void seek_points_save (SeekPoints * sp, const char * filename, VFSFile * file);
+void seek_points_free (SeekPoints * sp);
+bool_t seek_points_wanted (const SeekPoints * sp, int64_t sample);
+void seek_points_add (SeekPoints * sp, int64_t sample, int64_t offset);
+const SeekPoint * seek_points_find (const SeekPoints * sp, int64_t sample);
+
 #endif
@@ -0,0 +1,632 @@
+/*
+ *  Parallel frame decoding for the FLAC decoder plugin
+ *  Copyright (C) 2012 Audacious development team
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Parallel frame decoding.
+ *
+ * FLAC frames can be decoded independently of each other.  The playback
+ * thread reads the file ahead of the play position and splits it into frames
+ * by their headers.  A header is only accepted if its CRC-8 matches and its
+ * frame (or sample) number follows the previous one, so stray sync codes
+ * inside audio data are not mistaken for frames.  Each frame becomes a job.
+ * A pool of worker threads decodes the jobs, and each worker has its own
+ * FLAC__StreamDecoder primed with the file's STREAMINFO.  The playback thread
+ * collects the results in file order.
+ *
+ * If a frame cannot be decoded this way (or no valid header follows it), the
+ * caller is given its byte offset and falls back to the ordinary serial
+ * decoder from there.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <audacious/debug.h>
+
+#include "flacng.h"
+
+#define JOBS_PER_THREAD 4
+#define MAX_THREADS 8
+#define READ_CHUNK 65536
+#define MAX_HEADER 16
+#define STREAMINFO_HEADER (4 + 4 + FLAC__STREAM_METADATA_STREAMINFO_LENGTH)
+
+typedef enum {
+    JOB_FREE,
+    JOB_PENDING,
+    JOB_BUSY,
+    JOB_DONE,
+    JOB_FAILED
+} JobState;
+
+typedef struct {
+    JobState state;
+    unsigned char * data;
+    int len, size;
+    int32_t * out;
+    unsigned out_used;
+    int64_t offset;         /* in the file */
+    int64_t sample;         /* first sample of the frame */
+} Job;
+
+typedef struct {
+    callback_info info;     /* must come first; write_callback casts to it */
+    ParallelDecoder * pd;
+    FLAC__StreamDecoder * decoder;
+    const unsigned char * src;
+    int src_len;
+    bool_t failed;
+    pthread_t thread;
+} Worker;
+
+typedef struct {
+    int len;
+    int blocking;           /* 0 = fixed block size, 1 = variable */
+    uint64_t number;        /* frame number, or sample number if variable */
+    unsigned blocksize;
+} FrameHeader;
+
+struct ParallelDecoder {
+    VFSFile * file;
+    unsigned char streaminfo[STREAMINFO_HEADER];
+    unsigned channels, max_blocksize;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool_t quit;
+    int n_workers;
+    Worker * workers;
+
+    Job * jobs;
+    int n_jobs, head, count;
+
+    /* raw file data not yet split into jobs */
+    unsigned char * buf;
+    int buf_pos, buf_len, buf_size;
+    int64_t buf_offset;     /* file offset of buf[0] */
+    bool_t eof;
+    bool_t synced;
+    int blocking;
+    uint64_t next_number;
+};
+
+/* CRC-8, polynomial x^8 + x^2 + x + 1, as used in FLAC frame headers */
+static unsigned char crc8 (const unsigned char * data, int len)
+{
+    unsigned char crc = 0;
+
+    while (len --)
+    {
+        crc ^= * data ++;
+
+        for (int i = 0; i < 8; i ++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+
+    return crc;
+}
+
+/* Returns the header length if b points to a valid frame header, 0 if not. */
+static int parse_header (ParallelDecoder * pd, const unsigned char * b, int
+ avail, FrameHeader * h)
+{
+    if (avail < 6 || b[0] != 0xff || (b[1] & 0xfe) != 0xf8)
+        return 0;
+
+    int bs_code = b[2] >> 4, rate_code = b[2] & 0xf;
+    int assignment = b[3] >> 4, size_code = (b[3] >> 1) & 7;
+
+    if (! bs_code || rate_code == 15 || assignment > 10 || size_code == 3 ||
+     size_code == 7 || (b[3] & 1))
+        return 0;
+
+    if ((assignment < 8 ? assignment + 1 : 2) != pd->channels)
+        return 0;
+
+    h->blocking = b[1] & 1;
+
+    /* frame or sample number, UTF-8 style */
+    int pos = 4, extra;
+    uint64_t number;
+
+    if (! (b[pos] & 0x80)) { number = b[pos]; extra = 0; }
+    else if ((b[pos] & 0xe0) == 0xc0) { number = b[pos] & 0x1f; extra = 1; }
+    else if ((b[pos] & 0xf0) == 0xe0) { number = b[pos] & 0x0f; extra = 2; }
+    else if ((b[pos] & 0xf8) == 0xf0) { number = b[pos] & 0x07; extra = 3; }
+    else if ((b[pos] & 0xfc) == 0xf8) { number = b[pos] & 0x03; extra = 4; }
+    else if ((b[pos] & 0xfe) == 0xfc) { number = b[pos] & 0x01; extra = 5; }
+    else if (b[pos] == 0xfe) { number = 0; extra = 6; }
+    else
+        return 0;
+
+    pos ++;
+
+    if (pos + extra + 4 > avail)
+        return 0;
+
+    while (extra --)
+    {
+        if ((b[pos] & 0xc0) != 0x80)
+            return 0;
+
+        number = (number << 6) | (b[pos ++] & 0x3f);
+    }
+
+    h->number = number;
+
+    if (bs_code == 1)
+        h->blocksize = 192;
+    else if (bs_code <= 5)
+        h->blocksize = 576 << (bs_code - 2);
+    else if (bs_code == 6)
+        h->blocksize = b[pos ++] + 1;
+    else if (bs_code == 7)
+    {
+        h->blocksize = ((b[pos] << 8) | b[pos + 1]) + 1;
+        pos += 2;
+    }
+    else
+        h->blocksize = 256 << (bs_code - 8);
+
+    if (rate_code == 12)
+        pos ++;
+    else if (rate_code == 13 || rate_code == 14)
+        pos += 2;
+
+    if (pos + 1 > avail || h->blocksize > pd->max_blocksize)
+        return 0;
+
+    if (crc8 (b, pos) != b[pos])
+        return 0;
+
+    h->len = pos + 1;
+    return h->len;
+}
+
+static bool_t expected_header (ParallelDecoder * pd, const FrameHeader * h)
+{
+    if (! pd->synced)
+        return TRUE;
+
+    return (h->blocking == pd->blocking && h->number == pd->next_number);
+}
+
+static bool_t fill_buffer (ParallelDecoder * pd)
+{
+    if (pd->eof)
+        return FALSE;
+
+    if (pd->buf_pos > 0)
+    {
+        memmove (pd->buf, pd->buf + pd->buf_pos, pd->buf_len - pd->buf_pos);
+        pd->buf_offset += pd->buf_pos;
+        pd->buf_len -= pd->buf_pos;
+        pd->buf_pos = 0;
+    }
+
+    if (pd->buf_size - pd->buf_len < READ_CHUNK)
+    {
+        pd->buf_size = pd->buf_len + READ_CHUNK;
+        pd->buf = realloc (pd->buf, pd->buf_size);
+    }
+
+    int64_t read = vfs_fread (pd->buf + pd->buf_len, 1, READ_CHUNK, pd->file);
+
+    if (read <= 0)
+    {
+        pd->eof = TRUE;
+        return FALSE;
+    }
+
+    pd->buf_len += read;
+    return TRUE;
+}
+
+/* Cuts the next frame out of the read buffer into a job. */
+static bool_t next_frame (ParallelDecoder * pd, Job * job)
+{
+    FrameHeader h, next;
+
+    /* find the start of the frame */
+    while (1)
+    {
+        while (pd->buf_pos + MAX_HEADER <= pd->buf_len || (pd->eof &&
+         pd->buf_pos < pd->buf_len))
+        {
+            if (parse_header (pd, pd->buf + pd->buf_pos, pd->buf_len -
+             pd->buf_pos, & h) && expected_header (pd, & h))
+                goto FOUND;
+
+            if (pd->synced)
+                return FALSE;  /* lost sync; let the serial decoder handle it */
+
+            pd->buf_pos ++;
+        }
+
+        if (! fill_buffer (pd))
+            return FALSE;
+    }
+
+FOUND:
+    pd->synced = TRUE;
+    pd->blocking = h.blocking;
+    pd->next_number = h.number + (h.blocking ? h.blocksize : 1);
+
+    /* and the start of the one after it */
+    int end = pd->buf_pos + h.len;
+
+    while (1)
+    {
+        int limit = pd->eof ? pd->buf_len : pd->buf_len - MAX_HEADER;
+
+        for (; end < limit; end ++)
+        {
+            if (pd->buf[end] == 0xff && parse_header (pd, pd->buf + end,
+             pd->buf_len - end, & next) && expected_header (pd, & next))
+                goto COPY;
+        }
+
+        if (pd->eof)
+            break;  /* the last frame runs to the end of the file */
+
+        int offset = end - pd->buf_pos;
+        fill_buffer (pd);
+        end = pd->buf_pos + offset;
+    }
+
+COPY:;
+    int len = end - pd->buf_pos;
+
+    if (job->size < len)
+    {
+        job->size = len;
+        job->data = realloc (job->data, len);
+    }
+
+    memcpy (job->data, pd->buf + pd->buf_pos, len);
+    job->len = len;
+    job->offset = pd->buf_offset + pd->buf_pos;
+    job->out_used = 0;
+    pd->buf_pos = end;
+
+    return TRUE;
+}
+
+static FLAC__StreamDecoderReadStatus worker_read (const FLAC__StreamDecoder *
+ decoder, FLAC__byte buffer[], size_t * bytes, void * client_data)
+{
+    Worker * w = client_data;
+
+    if (! w->src_len)
+    {
+        * bytes = 0;
+        return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+    }
+
+    if (* bytes > w->src_len)
+        * bytes = w->src_len;
+
+    memcpy (buffer, w->src, * bytes);
+    w->src += * bytes;
+    w->src_len -= * bytes;
+
+    return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderWriteStatus worker_write (const FLAC__StreamDecoder *
+ decoder, const FLAC__Frame * frame, const FLAC__int32 * const buffer[], void *
+ client_data)
+{
+    Worker * w = client_data;
+
+    if (frame->header.blocksize > w->pd->max_blocksize)
+    {
+        w->failed = TRUE;
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+
+    return write_callback (decoder, frame, buffer, & w->info);
+}
+
+static void worker_metadata (const FLAC__StreamDecoder * decoder, const
+ FLAC__StreamMetadata * metadata, void * client_data)
+{
+}
+
+/* libFLAC substitutes silence for frames that fail the CRC check, so any
+ * reported error counts as a failed job. */
+static void worker_error (const FLAC__StreamDecoder * decoder,
+ FLAC__StreamDecoderErrorStatus status, void * client_data)
+{
+    ((Worker *) client_data)->failed = TRUE;
+}
+
+static bool_t decode_job (Worker * w, Job * job)
+{
+    FLAC__stream_decoder_flush (w->decoder);
+
+    w->src = job->data;
+    w->src_len = job->len;
+    w->failed = FALSE;
+    w->info.write_pointer = job->out;
+    w->info.buffer_used = 0;
+
+    if (! FLAC__stream_decoder_process_single (w->decoder) || w->failed ||
+     ! w->info.buffer_used)
+        return FALSE;
+
+    job->out_used = w->info.buffer_used;
+    job->sample = w->info.frame_sample;
+    return TRUE;
+}
+
+static void * worker_thread (void * arg)
+{
+    Worker * w = arg;
+    ParallelDecoder * pd = w->pd;
+
+    pthread_mutex_lock (& pd->mutex);
+
+    while (! pd->quit)
+    {
+        Job * job = NULL;
+
+        for (int i = 0; i < pd->count; i ++)
+        {
+            Job * j = & pd->jobs[(pd->head + i) % pd->n_jobs];
+
+            if (j->state == JOB_PENDING)
+            {
+                job = j;
+                break;
+            }
+        }
+
+        if (! job)
+        {
+            pthread_cond_wait (& pd->cond, & pd->mutex);
+            continue;
+        }
+
+        job->state = JOB_BUSY;
+        pthread_mutex_unlock (& pd->mutex);
+
+        bool_t ok = decode_job (w, job);
+
+        pthread_mutex_lock (& pd->mutex);
+        job->state = ok ? JOB_DONE : JOB_FAILED;
+        pthread_cond_broadcast (& pd->cond);
+    }
+
+    pthread_mutex_unlock (& pd->mutex);
+    return NULL;
+}
+
+static bool_t worker_init (ParallelDecoder * pd, Worker * w, const
+ callback_info * main)
+{
+    w->pd = pd;
+    w->info.bits_per_sample = main->bits_per_sample;
+    w->info.sample_rate = main->sample_rate;
+    w->info.channels = main->channels;
+    w->info.float_output = main->float_output;
+
+    if (! (w->decoder = FLAC__stream_decoder_new ()))
+        return FALSE;
+
+    if (FLAC__stream_decoder_init_stream (w->decoder, worker_read, NULL, NULL,
+     NULL, NULL, worker_write, worker_metadata, worker_error, w) !=
+     FLAC__STREAM_DECODER_INIT_STATUS_OK)
+        return FALSE;
+
+    w->src = pd->streaminfo;
+    w->src_len = sizeof pd->streaminfo;
+
+    return FLAC__stream_decoder_process_until_end_of_metadata (w->decoder);
+}
+
+ParallelDecoder * parallel_new (VFSFile * file, const callback_info * main)
+{
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 2)
+        return NULL;
+
+    ParallelDecoder * pd = calloc (1, sizeof (ParallelDecoder));
+    unsigned char * si = pd->streaminfo;
+
+    pd->file = file;
+    pd->channels = main->channels;
+
+    /* "fLaC" and the STREAMINFO block, flagged as the last metadata block */
+    if (vfs_fseek (file, 0, SEEK_SET) < 0 || vfs_fread (si, 1, sizeof
+     pd->streaminfo, file) != sizeof pd->streaminfo || memcmp (si, "fLaC", 4) ||
+     (si[4] & 0x7f) != FLAC__METADATA_TYPE_STREAMINFO)
+    {
+        free (pd);
+        return NULL;
+    }
+
+    si[4] |= 0x80;
+    pd->max_blocksize = (si[10] << 8) | si[11];
+
+    if (! pd->max_blocksize)
+    {
+        free (pd);
+        return NULL;
+    }
+
+    pthread_mutex_init (& pd->mutex, NULL);
+    pthread_cond_init (& pd->cond, NULL);
+
+    pd->n_workers = MIN (cpus, MAX_THREADS);
+    pd->workers = calloc (pd->n_workers, sizeof (Worker));
+    pd->n_jobs = pd->n_workers * JOBS_PER_THREAD;
+    pd->jobs = calloc (pd->n_jobs, sizeof (Job));
+
+    for (int i = 0; i < pd->n_jobs; i ++)
+        pd->jobs[i].out = malloc (sizeof (int32_t) * pd->max_blocksize *
+         pd->channels);
+
+    for (int i = 0; i < pd->n_workers; i ++)
+    {
+        if (! worker_init (pd, & pd->workers[i], main))
+        {
+            FLACNG_ERROR ("Could not set up parallel decoding.\n");
+            pd->n_workers = i + 1;  /* clean up this one too, without a thread */
+            pd->workers[i].thread = 0;
+            parallel_free (pd);
+            return NULL;
+        }
+
+        pthread_create (& pd->workers[i].thread, NULL, worker_thread,
+         & pd->workers[i]);
+    }
+
+    AUDDBG ("Parallel decoding with %d threads, %d jobs.\n", pd->n_workers,
+     pd->n_jobs);
+    return pd;
+}
+
+void parallel_free (ParallelDecoder * pd)
+{
+    pthread_mutex_lock (& pd->mutex);
+    pd->quit = TRUE;
+    pthread_cond_broadcast (& pd->cond);
+    pthread_mutex_unlock (& pd->mutex);
+
+    for (int i = 0; i < pd->n_workers; i ++)
+    {
+        Worker * w = & pd->workers[i];
+
+        if (w->thread)
+            pthread_join (w->thread, NULL);
+        if (w->decoder)
+            FLAC__stream_decoder_delete (w->decoder);
+    }
+
+    for (int i = 0; i < pd->n_jobs; i ++)
+    {
+        free (pd->jobs[i].data);
+        free (pd->jobs[i].out);
+    }
+
+    pthread_cond_destroy (& pd->cond);
+    pthread_mutex_destroy (& pd->mutex);
+
+    free (pd->workers);
+    free (pd->jobs);
+    free (pd->buf);
+    free (pd);
+}
+
+/* Drops all queued work and restarts at the given byte offset, which must be
+ * the start of a frame. */
+bool_t parallel_reset (ParallelDecoder * pd, int64_t offset)
+{
+    pthread_mutex_lock (& pd->mutex);
+
+    for (int i = 0; i < pd->count; i ++)
+    {
+        Job * job = & pd->jobs[(pd->head + i) % pd->n_jobs];
+
+        while (job->state == JOB_BUSY)
+            pthread_cond_wait (& pd->cond, & pd->mutex);
+
+        job->state = JOB_FREE;
+    }
+
+    pd->head = pd->count = 0;
+    pthread_mutex_unlock (& pd->mutex);
+
+    pd->buf_pos = pd->buf_len = 0;
+    pd->buf_offset = offset;
+    pd->eof = FALSE;
+    pd->synced = FALSE;
+
+    return (vfs_fseek (pd->file, offset, SEEK_SET) == 0);
+}
+
+/* Returns 1 and the decoded samples, file offset and first sample number of
+ * the next frame, 0 at the end of the file, or -1 with the file offset to
+ * resume serial decoding from.  A frame that was returned must be released
+ * with parallel_release() before the next call. */
+int parallel_next (ParallelDecoder * pd, int32_t * * out, unsigned * used,
+ int64_t * offset, int64_t * sample)
+{
+    pthread_mutex_lock (& pd->mutex);
+
+    while (pd->count < pd->n_jobs)
+    {
+        Job * job = & pd->jobs[(pd->head + pd->count) % pd->n_jobs];
+
+        pthread_mutex_unlock (& pd->mutex);
+        bool_t found = next_frame (pd, job);
+        pthread_mutex_lock (& pd->mutex);
+
+        if (! found)
+            break;
+
+        job->state = JOB_PENDING;
+        pd->count ++;
+        pthread_cond_broadcast (& pd->cond);
+    }
+
+    if (! pd->count)
+    {
+        pthread_mutex_unlock (& pd->mutex);
+
+        /* no frame header where one was expected */
+        if (pd->eof && pd->buf_pos >= pd->buf_len)
+            return 0;
+
+        * offset = pd->buf_offset + pd->buf_pos;
+        return -1;
+    }
+
+    Job * job = & pd->jobs[pd->head];
+
+    while (job->state == JOB_PENDING || job->state == JOB_BUSY)
+        pthread_cond_wait (& pd->cond, & pd->mutex);
+
+    pthread_mutex_unlock (& pd->mutex);
+
+    if (job->state == JOB_FAILED)
+    {
+        * offset = job->offset;
+        return -1;
+    }
+
+    * out = job->out;
+    * used = job->out_used;
+    * offset = job->offset;
+    * sample = job->sample;
+    return 1;
+}
+
+void parallel_release (ParallelDecoder * pd)
+{
+    pthread_mutex_lock (& pd->mutex);
+    pd->jobs[pd->head].state = JOB_FREE;
+    pd->head = (pd->head + 1) % pd->n_jobs;
+    pd->count --;
+    pthread_mutex_unlock (& pd->mutex);
+}
@@ -21,9 +21,15 @@
 #include <pthread.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <audacious/debug.h>
 #include <audacious/i18n.h>
+#include <audacious/misc.h>
 #include <audacious/plugin.h>
+#include <audacious/preferences.h>
 
 #include "config.h"
 #include "flacng.h"
@@ -34,10 +40,17 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static int seek_value;
 static bool_t stop_flag = FALSE;
 
+static const char * const flac_defaults[] = {
+ "float_output", "FALSE",
+ "parallel_decoding", "FALSE",
+ NULL};
+
 static bool_t flac_init (void)
 {
     FLAC__StreamDecoderInitStatus ret;
 
+    aud_config_set_defaults ("flacng", flac_defaults);
+
     /* Callback structure and decoder for main decoding loop */
 
     if ((info = init_callback_info()) == NULL)
@@ -52,6 +65,9 @@ static bool_t flac_init (void)
         return FALSE;
     }
 
+    /* used to decide whether our own seek points are needed */
+    FLAC__stream_decoder_set_metadata_respond (decoder, FLAC__METADATA_TYPE_SEEKTABLE);
+
     if (FLAC__STREAM_DECODER_INIT_STATUS_OK != (ret = FLAC__stream_decoder_init_stream(
         decoder,
         read_callback,
@@ -93,30 +109,46 @@ bool_t flac_is_our_fd(const char *filename, VFSFile *fd)
     return ! strncmp (buf, "fLaC", sizeof buf);
 }
 
+/* The decoded samples always fit the target width, so the saturating packs
+ * give the same result as truncation. */
 static void squeeze_audio(int32_t* src, void* dst, unsigned count, unsigned res)
 {
-    int i;
+    int i = 0;
     int32_t* rp = src;
     int8_t*  wp = dst;
     int16_t* wp2 = dst;
-    int32_t* wp4 = dst;
 
     switch (res)
     {
         case 8:
-            for (i = 0; i < count; i++, wp++, rp++)
+#ifdef __SSE2__
+            for (; i + 16 <= count; i += 16, wp += 16, rp += 16)
+            {
+                __m128i a = _mm_packs_epi32 (_mm_loadu_si128 ((__m128i *) rp),
+                 _mm_loadu_si128 ((__m128i *) (rp + 4)));
+                __m128i b = _mm_packs_epi32 (_mm_loadu_si128 ((__m128i *) (rp + 8)),
+                 _mm_loadu_si128 ((__m128i *) (rp + 12)));
+                _mm_storeu_si128 ((__m128i *) wp, _mm_packs_epi16 (a, b));
+            }
+#endif
+            for (; i < count; i++, wp++, rp++)
                 *wp = *rp & 0xff;
             break;
 
         case 16:
-            for (i = 0; i < count; i++, wp2++, rp++)
+#ifdef __SSE2__
+            for (; i + 8 <= count; i += 8, wp2 += 8, rp += 8)
+                _mm_storeu_si128 ((__m128i *) wp2, _mm_packs_epi32
+                 (_mm_loadu_si128 ((__m128i *) rp), _mm_loadu_si128 ((__m128i *)
+                 (rp + 4))));
+#endif
+            for (; i < count; i++, wp2++, rp++)
                 *wp2 = *rp & 0xffff;
             break;
 
         case 24:
         case 32:
-            for (i = 0; i < count; i++, wp4++, rp++)
-                *wp4 = *rp;
+            memcpy (dst, src, sizeof (int32_t) * count);
             break;
 
         default:
@@ -124,6 +156,61 @@ static void squeeze_audio(int32_t* src, void* dst, unsigned count, unsigned res)
     }
 }
 
+/* Points the serial decoder at a frame boundary after the parallel decoder
+ * has moved the file position. */
+static void resume_serial (VFSFile * file, int64_t offset)
+{
+    if (vfs_fseek (file, offset, SEEK_SET) < 0 ||
+     FLAC__stream_decoder_flush (decoder) == FALSE)
+        FLACNG_ERROR("Could not resume serial decoding!\n");
+}
+
+static void stop_parallel (ParallelDecoder * * parallel, VFSFile * file,
+ int64_t offset)
+{
+    parallel_free (* parallel);
+    * parallel = NULL;
+    resume_serial (file, offset);
+}
+
+/* Positions the decoder using a recorded seek point and decodes up to the
+ * frame containing the given sample, dropping the part of it before the
+ * sample.  Returns FALSE if libFLAC should do the seek instead. */
+static bool_t seek_with_points (const SeekPoints * points, VFSFile * file,
+ int64_t sample)
+{
+    const SeekPoint * point = seek_points_find (points, sample);
+
+    if (! point || (info->total_samples && sample >= info->total_samples))
+        return FALSE;
+
+    if (seek_callback (decoder, point->offset, info) !=
+     FLAC__STREAM_DECODER_SEEK_STATUS_OK || FLAC__stream_decoder_flush
+     (decoder) == FALSE)
+        return FALSE;
+
+    while (1)
+    {
+        reset_info (info);
+
+        if (FLAC__stream_decoder_process_single (decoder) == FALSE ||
+         ! info->buffer_used || info->frame_sample > sample)
+            return FALSE;
+
+        if (sample < info->frame_sample + info->buffer_used / info->channels)
+            break;
+    }
+
+    unsigned skip = (sample - info->frame_sample) * info->channels;
+
+    memmove (info->output_buffer, info->output_buffer + skip, sizeof (int32_t)
+     * (info->buffer_used - skip));
+    info->buffer_used -= skip;
+    info->frame_sample = sample;  /* the buffer now starts here */
+
+    return TRUE;
+}
+
 static bool_t flac_play (InputPlayback * playback, const char * filename,
  VFSFile * file, int start_time, int stop_time, bool_t pause)
 {
@@ -134,6 +221,8 @@ static bool_t flac_play (InputPlayback * playback, const char * filename,
     bool_t error = FALSE;
 
     info->fd = file;
+    info->float_output = aud_get_bool ("flacng", "float_output");
+    info->has_seektable = FALSE;
 
     if (read_metadata(decoder, info) == FALSE)
     {
@@ -149,8 +238,8 @@ static bool_t flac_play (InputPlayback * playback, const char * filename,
         goto ERR_NO_CLOSE;
     }
 
-    if (! playback->output->open_audio (SAMPLE_FMT (info->bits_per_sample),
-        info->sample_rate, info->channels))
+    if (! playback->output->open_audio (info->float_output ? FMT_FLOAT :
+        SAMPLE_FMT (info->bits_per_sample), info->sample_rate, info->channels))
     {
         error = TRUE;
         goto ERR_NO_CLOSE;
@@ -171,8 +260,31 @@ static bool_t flac_play (InputPlayback * playback, const char * filename,
         samples_remaining = (int64_t) (stop_time - start_time) *
          info->sample_rate / 1000 * info->channels;
 
-    while (samples_remaining && FLAC__stream_decoder_get_state(decoder) !=
-     FLAC__STREAM_DECODER_END_OF_STREAM)
+    ParallelDecoder * parallel = NULL;
+    FLAC__uint64 position;
+    int64_t next_sample = 0;  /* first sample of the frame expected next */
+
+    SeekPoints points;
+    bool_t use_points = ! info->has_seektable && ! vfs_is_streaming (file);
+
+    if (use_points)
+    {
+        seek_points_load (& points, filename, file, info->sample_rate);
+
+        if (FLAC__stream_decoder_get_decode_position (decoder, & position))
+            seek_points_add (& points, 0, position);
+    }
+
+    if (aud_get_bool ("flacng", "parallel_decoding") && ! vfs_is_streaming (file)
+     && FLAC__stream_decoder_get_decode_position (decoder, & position) &&
+     (parallel = parallel_new (file, info)) == NULL)
+        resume_serial (file, position);  /* parallel_new moved the file position */
+
+    if (parallel && ! parallel_reset (parallel, position))
+        stop_parallel (& parallel, file, position);
+
+    while (samples_remaining && (parallel || FLAC__stream_decoder_get_state
+     (decoder) != FLAC__STREAM_DECODER_END_OF_STREAM))
     {
         pthread_mutex_lock (& mutex);
 
@@ -185,8 +297,20 @@ static bool_t flac_play (InputPlayback * playback, const char * filename,
         if (seek_value >= 0)
         {
             playback->output->flush (seek_value);
-            FLAC__stream_decoder_seek_absolute (decoder, (int64_t)
-             seek_value * info->sample_rate / 1000);
+            int64_t sample = (int64_t) seek_value * info->sample_rate / 1000;
+
+            if (! use_points || ! seek_with_points (& points, file, sample))
+            {
+                reset_info (info);
+                FLAC__stream_decoder_flush (decoder);
+                FLAC__stream_decoder_seek_absolute (decoder, sample);
+            }
+
+            /* the parallel decoder picks up after the frame that the seek
+             * decoded */
+            if (parallel && (! FLAC__stream_decoder_get_decode_position
+             (decoder, & position) || ! parallel_reset (parallel, position)))
+                stop_parallel (& parallel, file, position);
 
             if (stop_time >= 0)
                 samples_remaining = (int64_t) (stop_time - seek_value) *
@@ -197,25 +321,98 @@ static bool_t flac_play (InputPlayback * playback, const char * filename,
 
         pthread_mutex_unlock (& mutex);
 
-        /* Try to decode a single frame of audio */
-        if (FLAC__stream_decoder_process_single(decoder) == FALSE)
+        int32_t * out = info->output_buffer;
+        unsigned used;
+        bool_t from_parallel = FALSE;
+
+        if (info->buffer_used)
         {
-            FLACNG_ERROR("Error while decoding!\n");
-            error = TRUE;
-            break;
+            /* left over from a seek */
+            used = info->buffer_used;
+
+            /* the decode position is the start of the next frame */
+            next_sample = info->frame_sample + used / info->channels;
+
+            if (use_points && used && seek_points_wanted (& points, next_sample)
+             && FLAC__stream_decoder_get_decode_position (decoder, & position))
+                seek_points_add (& points, next_sample, position);
         }
+        else if (parallel)
+        {
+            int64_t offset, sample;
+            int ret = parallel_next (parallel, & out, & used, & offset, & sample);
 
-        if (info->buffer_used >= samples_remaining)
-            info->buffer_used = samples_remaining;
+            if (ret == 0)
+                break;
 
-        squeeze_audio(info->output_buffer, play_buffer, info->buffer_used, info->bits_per_sample);
-        playback->output->write_audio(play_buffer, info->buffer_used * SAMPLE_SIZE(info->bits_per_sample));
+            if (ret < 0)
+            {
+                AUDDBG ("Parallel decoding failed at %d, continuing serially.\n",
+                 (int) offset);
+                stop_parallel (& parallel, file, offset);
+                continue;
+            }
 
-        samples_remaining -= info->buffer_used;
+            if (use_points)
+                seek_points_add (& points, sample, offset);
+
+            next_sample = sample + used / info->channels;
+            from_parallel = TRUE;
+        }
+        else
+        {
+            /* Before decoding, the decode position is the byte offset of the
+             * frame to come.  It is only asked for when a point is due, since
+             * it costs a tell on the file. */
+            bool_t want_point = use_points && seek_points_wanted (& points,
+             next_sample) && FLAC__stream_decoder_get_decode_position (decoder,
+             & position);
+
+            /* Try to decode a single frame of audio */
+            if (FLAC__stream_decoder_process_single(decoder) == FALSE)
+            {
+                FLACNG_ERROR("Error while decoding!\n");
+                error = TRUE;
+                break;
+            }
+
+            used = info->buffer_used;
+
+            if (want_point && used && info->frame_sample == next_sample)
+                seek_points_add (& points, next_sample, position);
+
+            if (used)
+                next_sample = info->frame_sample + used / info->channels;
+        }
+
+        if (used >= samples_remaining)
+            used = samples_remaining;
+
+        if (info->float_output)
+            playback->output->write_audio(out, used * sizeof (float));
+        else
+        {
+            squeeze_audio(out, play_buffer, used, info->bits_per_sample);
+            playback->output->write_audio(play_buffer, used * SAMPLE_SIZE(info->bits_per_sample));
+        }
+
+        samples_remaining -= used;
+
+        if (from_parallel)
+            parallel_release (parallel);
 
         reset_info(info);
     }
 
+    if (parallel)
+        parallel_free (parallel);
+
+    if (use_points)
+    {
+        seek_points_save (& points, filename, file);
+        seek_points_free (& points);
+    }
+
     pthread_mutex_lock (& mutex);
     stop_flag = TRUE;
     pthread_mutex_unlock (& mutex);
@@ -271,6 +468,18 @@ static const char flac_about[] =
     "Ralf Ertzinger <ralf@skytale.net>\n\n"
     "http://www.skytale.net/projects/bmp-flac2/");
 
+static const PreferencesWidget flac_widgets[] = {
+ {WIDGET_LABEL, N_("<b>Output</b>")},
+ {WIDGET_CHK_BTN, N_("Output floating point samples"),
+  .cfg_type = VALUE_BOOLEAN, .csect = "flacng", .cname = "float_output"},
+ {WIDGET_LABEL, N_("<b>Decoding</b>")},
+ {WIDGET_CHK_BTN, N_("Decode frames in parallel on multi-core systems"),
+  .cfg_type = VALUE_BOOLEAN, .csect = "flacng", .cname = "parallel_decoding"}};
+
+static const PluginPreferences flac_prefs = {
+ .widgets = flac_widgets,
+ .n_widgets = sizeof flac_widgets / sizeof flac_widgets[0]};
+
 static const char *flac_fmts[] = { "flac", "fla", NULL };
 
 AUD_INPUT_PLUGIN
@@ -278,6 +487,7 @@ AUD_INPUT_PLUGIN
     .name = N_("FLAC Decoder"),
     .domain = PACKAGE,
     .about_text = flac_about,
+    .prefs = & flac_prefs,
     .init = flac_init,
     .cleanup = flac_cleanup,
     .play = flac_play,
@@ -21,6 +21,10 @@
 #include <string.h>
 #include <FLAC/all.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <audacious/debug.h>
 
 #include "flacng.h"
@@ -112,6 +116,75 @@ FLAC__StreamDecoderLengthStatus length_callback(const FLAC__StreamDecoder *decod
     return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
 }
 
+/* Interleaves the decoder's planar output.  With float output the scaling to
+ * [-1, 1) is done in the same pass, so the samples are touched only once. */
+static void interleave_int (const FLAC__int32 * const in[], int32_t * out,
+ unsigned channels, unsigned samples)
+{
+    unsigned i = 0;
+
+    if (channels == 1)
+    {
+        memcpy (out, in[0], sizeof (int32_t) * samples);
+        return;
+    }
+
+#ifdef __SSE2__
+    if (channels == 2)
+    {
+        for (; i + 4 <= samples; i += 4, out += 8)
+        {
+            __m128i l = _mm_loadu_si128 ((const __m128i *) (in[0] + i));
+            __m128i r = _mm_loadu_si128 ((const __m128i *) (in[1] + i));
+            _mm_storeu_si128 ((__m128i *) out, _mm_unpacklo_epi32 (l, r));
+            _mm_storeu_si128 ((__m128i *) (out + 4), _mm_unpackhi_epi32 (l, r));
+        }
+    }
+#endif
+
+    for (; i < samples; i ++)
+    {
+        for (unsigned channel = 0; channel < channels; channel ++)
+            * out ++ = in[channel][i];
+    }
+}
+
+static void interleave_float (const FLAC__int32 * const in[], float * out,
+ unsigned channels, unsigned samples, unsigned bits)
+{
+    float scale = 1.0f / (1u << (bits - 1));
+    unsigned i = 0;
+
+#ifdef __SSE2__
+    __m128 vscale = _mm_set1_ps (scale);
+
+    if (channels == 2)
+    {
+        for (; i + 4 <= samples; i += 4, out += 8)
+        {
+            __m128 l = _mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128 ((const
+             __m128i *) (in[0] + i))), vscale);
+            __m128 r = _mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128 ((const
+             __m128i *) (in[1] + i))), vscale);
+            _mm_storeu_ps (out, _mm_unpacklo_ps (l, r));
+            _mm_storeu_ps (out + 4, _mm_unpackhi_ps (l, r));
+        }
+    }
+    else if (channels == 1)
+    {
+        for (; i + 4 <= samples; i += 4, out += 4)
+            _mm_storeu_ps (out, _mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128
+             ((const __m128i *) (in[0] + i))), vscale));
+    }
+#endif
+
+    for (; i < samples; i ++)
+    {
+        for (unsigned channel = 0; channel < channels; channel ++)
+            * out ++ = in[channel][i] * scale;
+    }
+}
+
 FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 *const buffer[], void *client_data)
 {
     callback_info *info = (callback_info*) client_data;
@@ -122,14 +195,18 @@ FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *decoder
         return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
     }
 
-    for (long sample = 0; sample < frame->header.blocksize; sample++)
-    {
-        for (short channel = 0; channel < frame->header.channels; channel++)
-        {
-            *(info->write_pointer++) = buffer[channel][sample];
-            info->buffer_used += 1;
-        }
-    }
+    unsigned count = frame->header.blocksize * frame->header.channels;
+
+    if (info->float_output)
+        interleave_float (buffer, (float *) info->write_pointer,
+         frame->header.channels, frame->header.blocksize, info->bits_per_sample);
+    else
+        interleave_int (buffer, info->write_pointer, frame->header.channels,
+         frame->header.blocksize);
+
+    info->write_pointer += count;
+    info->buffer_used += count;
+    info->frame_sample = frame->header.number.sample_number;
 
     return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
@@ -167,4 +244,15 @@ void metadata_callback(const FLAC__StreamDecoder *decoder, const FLAC__StreamMet
 
         AUDDBG("bitrate=%d\n", info->bitrate);
     }
+    else if (metadata->type == FLAC__METADATA_TYPE_SEEKTABLE)
+    {
+        for (unsigned i = 0; i < metadata->data.seek_table.num_points; i ++)
+        {
+            if (metadata->data.seek_table.points[i].sample_number !=
+             FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER)
+                info->has_seektable = TRUE;
+        }
+
+        AUDDBG("has_seektable=%d\n", info->has_seektable);
+    }
 }
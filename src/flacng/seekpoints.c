@@ -0,0 +1,183 @@
+/*
+ *  Persistent seek points for the FLAC decoder plugin
+ *  Copyright (C) 2012 Audacious development team
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Seek points for files without a SEEKTABLE block.
+ *
+ * Without a seek table, libFLAC finds a sample by bisecting the file, which
+ * costs a dozen scattered reads per seek over a network transport.  While a
+ * file plays, the byte offset of a frame every SEEK_POINT_SECONDS is
+ * recorded.  The points are stored under the user directory (see
+ * index-file.h).  A later seek then needs one read starting at the nearest
+ * point before the target.
+ */
+
+#include "../index-file/index-file.h"
+#include "flacng.h"
+
+#define SEEK_POINT_SECONDS 2
+#define INDEX_DIR "flacng-index"
+#define INDEX_MAGIC "AUDFLIX2"
+#define INDEX_MAX_POINTS (1 << 20)
+
+typedef struct {
+    int64_t step;
+    int32_t count;
+    int32_t reserved;
+} IndexData;
+
+/* FLAC frame sync code: 14 bits, then a reserved zero bit */
+static const unsigned char frame_sync[2] = {0xff, 0xf8};
+static const unsigned char frame_sync_mask[2] = {0xff, 0xfe};
+
+/* Returns the number of points before the given sample. */
+static int find_point (const SeekPoints * sp, int64_t sample)
+{
+    int low = 0, high = sp->count;
+
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+
+        if (sp->points[mid].sample < sample)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+void seek_points_load (SeekPoints * sp, const char * filename, VFSFile * file,
+ unsigned sample_rate)
+{
+    IndexFile f;
+    IndexData data;
+
+    memset (sp, 0, sizeof (SeekPoints));
+    sp->step = (int64_t) sample_rate * SEEK_POINT_SECONDS;
+
+    if (! index_file_open (& f, INDEX_DIR, INDEX_MAGIC, filename, file))
+        return;
+
+    if (fread (& data, sizeof data, 1, f.handle) != 1 || data.step != sp->step ||
+     data.count <= 0 || data.count > INDEX_MAX_POINTS)
+        goto FAIL;
+
+    sp->points = malloc (sizeof (SeekPoint) * data.count);
+    sp->size = data.count;
+
+    if (fread (sp->points, sizeof (SeekPoint), data.count, f.handle) !=
+     data.count)
+        goto FAIL;
+
+    if (! f.local && ! (index_file_has_sync (file, sp->points[data.count /
+     2].offset, frame_sync, frame_sync_mask, 2) && index_file_has_sync (file,
+     sp->points[data.count - 1].offset, frame_sync, frame_sync_mask, 2)))
+    {
+        AUDDBG ("Seek points for %s do not match the file.\n", filename);
+        goto FAIL;
+    }
+
+    sp->count = data.count;
+    index_file_close (& f, TRUE);
+
+    AUDDBG ("Loaded %d seek points for %s.\n", sp->count, filename);
+    return;
+
+FAIL:
+    index_file_close (& f, FALSE);
+}
+
+void seek_points_save (SeekPoints * sp, const char * filename, VFSFile * file)
+{
+    IndexFile f;
+    IndexData data = {sp->step, sp->count, 0};
+
+    if (! sp->changed || ! sp->count)
+        return;
+
+    if (! index_file_create (& f, INDEX_DIR, INDEX_MAGIC, filename, file))
+        return;
+
+    bool_t ok = (fwrite (& data, sizeof data, 1, f.handle) == 1 && fwrite
+     (sp->points, sizeof (SeekPoint), sp->count, f.handle) == sp->count);
+
+    if (index_file_commit (& f, ok))
+    {
+        AUDDBG ("Saved %d seek points for %s.\n", sp->count, filename);
+        sp->changed = FALSE;
+    }
+}
+
+void seek_points_free (SeekPoints * sp)
+{
+    free (sp->points);
+    memset (sp, 0, sizeof (SeekPoints));
+}
+
+/* Playback may skip around, so the points are kept sorted and a new one is
+ * only taken where there is a gap of at least one step. */
+bool_t seek_points_wanted (const SeekPoints * sp, int64_t sample)
+{
+    if (sp->step <= 0 || sample < 0)
+        return FALSE;
+
+    int i = find_point (sp, sample);
+
+    if (i < sp->count && sp->points[i].sample - sample < sp->step)
+        return FALSE;
+    if (i > 0 && sample - sp->points[i - 1].sample < sp->step)
+        return FALSE;
+
+    return TRUE;
+}
+
+void seek_points_add (SeekPoints * sp, int64_t sample, int64_t offset)
+{
+    if (! seek_points_wanted (sp, sample) || sp->count >= INDEX_MAX_POINTS)
+        return;
+
+    if (sp->count == sp->size)
+    {
+        sp->size = sp->size ? sp->size * 2 : 256;
+        sp->points = realloc (sp->points, sizeof (SeekPoint) * sp->size);
+    }
+
+    int i = find_point (sp, sample);
+
+    memmove (sp->points + i + 1, sp->points + i, sizeof (SeekPoint) *
+     (sp->count - i));
+    sp->points[i].sample = sample;
+    sp->points[i].offset = offset;
+    sp->count ++;
+    sp->changed = TRUE;
+}
+
+/* Returns the last point at or before the given sample, or NULL if there is
+ * none close enough to beat libFLAC's own search. */
+const SeekPoint * seek_points_find (const SeekPoints * sp, int64_t sample)
+{
+    int i = find_point (sp, sample + 1);
+
+    if (i == 0 || sample - sp->points[i - 1].sample > 2 * sp->step)
+        return NULL;
+
+    return & sp->points[i - 1];
+}
@@ -17,6 +17,7 @@
  * the use of this software.
  */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,12 +31,52 @@
 
 #include "config.h"
 
+/* Files opened for reading only are read in large chunks, and the chunk after
+ * the one being consumed is fetched by a background thread.  On sftp, smb and
+ * ftp this turns many small reads, each a network round trip, into a few
+ * large ones that overlap with decoding.  Only one thread at a time touches
+ * the stream: before seeking, the caller waits for the fetch in progress if it
+ * covers the new position and cancels it otherwise.  Fetching ahead starts
+ * only once two chunks have been read in a row, so that reading the tags of
+ * a file (a header, then the tail) does not transfer data that is never
+ * used. */
+
+#define CHUNK_SIZE (256 * 1024)
+
+enum {
+    FETCH_IDLE,     /* nothing fetched */
+    FETCH_BUSY,     /* background thread is reading into the spare buffer */
+    FETCH_DONE,     /* spare buffer is filled */
+    FETCH_QUIT
+};
+
+typedef struct {
+    char * data;
+    int64_t offset;  /* stream position of data[0] */
+    int64_t len;
+} Chunk;
+
 typedef struct {
     GFile * file;
     GIOStream * iostream;
     GInputStream * istream;
     GOutputStream * ostream;
     GSeekable * seekable;
+
+    bool_t readahead;
+    Chunk chunks[2];
+    int cur;             /* chunk being consumed; the other one is fetched */
+    int64_t cur_pos;     /* read position within it */
+    int64_t stream_pos;  /* position of the underlying stream */
+    int64_t requests;    /* reads issued to the underlying stream */
+    int sequential;      /* chunks read in a row since opening or seeking */
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int fetch_state;
+    GError * fetch_error;
+    GCancellable * cancellable;
 } FileData;
 
 #define gio_error(...) do { \
@@ -51,6 +92,137 @@ typedef struct {
     } \
 } while (0)
 
+static void * fetch_worker (void * arg)
+{
+    FileData * data = arg;
+
+    pthread_mutex_lock (& data->mutex);
+
+    while (1)
+    {
+        while (data->fetch_state != FETCH_BUSY && data->fetch_state != FETCH_QUIT)
+            pthread_cond_wait (& data->cond, & data->mutex);
+
+        if (data->fetch_state == FETCH_QUIT)
+            break;
+
+        Chunk * chunk = & data->chunks[! data->cur];
+        GError * error = 0;
+        gsize readed = 0;
+
+        pthread_mutex_unlock (& data->mutex);
+
+        g_input_stream_read_all (data->istream, chunk->data, CHUNK_SIZE,
+         & readed, data->cancellable, & error);
+
+        pthread_mutex_lock (& data->mutex);
+
+        chunk->len = readed;
+        data->fetch_error = error;
+        data->requests ++;
+
+        if (data->fetch_state == FETCH_BUSY)
+            data->fetch_state = FETCH_DONE;
+
+        pthread_cond_broadcast (& data->cond);
+    }
+
+    pthread_mutex_unlock (& data->mutex);
+    return 0;
+}
+
+/* starts fetching the chunk that follows the current one */
+static void fetch_start (FileData * data)
+{
+    pthread_mutex_lock (& data->mutex);
+    data->chunks[! data->cur].offset = data->stream_pos;
+    data->fetch_state = FETCH_BUSY;
+    pthread_cond_broadcast (& data->cond);
+    pthread_mutex_unlock (& data->mutex);
+}
+
+/* waits for the fetch in progress, if any, and returns the resulting state */
+static int fetch_wait (FileData * data)
+{
+    pthread_mutex_lock (& data->mutex);
+
+    while (data->fetch_state == FETCH_BUSY)
+        pthread_cond_wait (& data->cond, & data->mutex);
+
+    int state = data->fetch_state;
+    pthread_mutex_unlock (& data->mutex);
+
+    return state;
+}
+
+/* forgets about the fetched chunk; no fetch may be in progress */
+static void fetch_reset (FileData * data)
+{
+    pthread_mutex_lock (& data->mutex);
+    data->fetch_state = FETCH_IDLE;
+    pthread_mutex_unlock (& data->mutex);
+}
+
+/* stops the fetch in progress, if any, and forgets about the fetched chunk */
+static void fetch_cancel (FileData * data)
+{
+    pthread_mutex_lock (& data->mutex);
+
+    if (data->fetch_state == FETCH_BUSY)
+    {
+        g_cancellable_cancel (data->cancellable);
+
+        while (data->fetch_state == FETCH_BUSY)
+            pthread_cond_wait (& data->cond, & data->mutex);
+
+        g_cancellable_reset (data->cancellable);
+    }
+
+    data->fetch_state = FETCH_IDLE;
+
+    if (data->fetch_error)
+    {
+        g_error_free (data->fetch_error);
+        data->fetch_error = 0;
+    }
+
+    pthread_mutex_unlock (& data->mutex);
+}
+
+/* makes the fetched chunk the current one and starts fetching the next */
+static bool_t fetch_advance (VFSFile * file, FileData * data)
+{
+    if (fetch_wait (data) == FETCH_IDLE)
+    {
+        fetch_start (data);
+        fetch_wait (data);
+    }
+
+    fetch_reset (data);
+
+    if (data->fetch_error)
+    {
+        GError * error = data->fetch_error;
+        data->fetch_error = 0;
+        CHECK_ERROR ("read from", vfs_get_filename (file));
+    }
+
+    data->cur = ! data->cur;
+    data->cur_pos = 0;
+    data->stream_pos += data->chunks[data->cur].len;
+
+    if (! data->chunks[data->cur].len)
+        return FALSE;
+
+    if (++ data->sequential >= 2)
+        fetch_start (data);
+
+    return TRUE;
+
+FAILED:
+    return FALSE;
+}
+
 static void * gio_fopen (const char * filename, const char * mode)
 {
     GError * error = 0;
@@ -112,6 +284,18 @@ static void * gio_fopen (const char * filename, const char * mode)
         goto FAILED;
     }
 
+    if (data->istream && ! data->ostream)
+    {
+        data->readahead = TRUE;
+        data->chunks[0].data = malloc (CHUNK_SIZE);
+        data->chunks[1].data = malloc (CHUNK_SIZE);
+        data->cancellable = g_cancellable_new ();
+
+        pthread_mutex_init (& data->mutex, 0);
+        pthread_cond_init (& data->cond, 0);
+        pthread_create (& data->thread, 0, fetch_worker, data);
+    }
+
     return data;
 
 FAILED:
@@ -119,11 +303,42 @@ FAILED:
     return 0;
 }
 
+static void gio_free (FileData * data)
+{
+    if (data->readahead)
+    {
+        pthread_mutex_lock (& data->mutex);
+        data->fetch_state = FETCH_QUIT;
+        pthread_cond_broadcast (& data->cond);
+        pthread_mutex_unlock (& data->mutex);
+
+        pthread_join (data->thread, 0);
+        pthread_mutex_destroy (& data->mutex);
+        pthread_cond_destroy (& data->cond);
+
+        if (data->fetch_error)
+            g_error_free (data->fetch_error);
+
+        free (data->chunks[0].data);
+        free (data->chunks[1].data);
+        g_object_unref (data->cancellable);
+    }
+
+    if (data->file)
+        g_object_unref (data->file);
+
+    free (data);
+}
+
 static int gio_fclose (VFSFile * file)
 {
     FileData * data = vfs_get_handle (file);
     GError * error = 0;
 
+    /* the stream must be idle before it is closed */
+    if (data->readahead)
+        fetch_cancel (data);
+
     if (data->iostream)
     {
         g_io_stream_close (data->iostream, 0, & error);
@@ -143,15 +358,11 @@ static int gio_fclose (VFSFile * file)
         CHECK_ERROR ("close", vfs_get_filename (file));
     }
 
-    if (data->file)
-        g_object_unref (data->file);
-
+    gio_free (data);
     return 0;
 
 FAILED:
-    if (data->file)
-        g_object_unref (data->file);
-
+    gio_free (data);
     return -1;
 }
 
@@ -166,6 +377,31 @@ static int64_t gio_fread (void * buf, int64_t size, int64_t nitems, VFSFile * fi
         return 0;
     }
 
+    if (data->readahead)
+    {
+        int64_t goal = size * nitems;
+        int64_t total = 0;
+
+        while (total < goal)
+        {
+            Chunk * chunk = & data->chunks[data->cur];
+
+            if (data->cur_pos < chunk->len)
+            {
+                int64_t copy = MIN (goal - total, chunk->len - data->cur_pos);
+                memcpy ((char *) buf + total, chunk->data + data->cur_pos, copy);
+                data->cur_pos += copy;
+                total += copy;
+            }
+            else if (! fetch_advance (file, data))
+                break;
+        }
+
+        return (size > 0) ? total / size : 0;
+    }
+
+    data->requests ++;
+
     int64_t readed = g_input_stream_read (data->istream, buf, size * nitems, 0, & error);
     CHECK_ERROR ("read from", vfs_get_filename (file));
 
@@ -217,6 +453,52 @@ static int gio_fseek (VFSFile * file, int64_t offset, int whence)
         return -1;
     }
 
+    if (data->readahead)
+    {
+        Chunk * chunk = & data->chunks[data->cur];
+
+        if (whence == SEEK_CUR)
+        {
+            offset += chunk->offset + data->cur_pos;
+            gwhence = G_SEEK_SET;
+        }
+
+        /* seeks within the current or the fetched chunk need no request */
+        if (gwhence == G_SEEK_SET && offset >= chunk->offset &&
+         offset <= chunk->offset + chunk->len)
+        {
+            data->cur_pos = offset - chunk->offset;
+            return 0;
+        }
+
+        Chunk * next = & data->chunks[! data->cur];
+
+        /* a fetch is only waited for if it covers the new position */
+        if (gwhence == G_SEEK_SET && offset >= next->offset && offset <
+         next->offset + CHUNK_SIZE && fetch_wait (data) == FETCH_DONE &&
+         ! data->fetch_error && offset <= next->offset + next->len)
+        {
+            fetch_advance (file, data);
+            data->cur_pos = offset - next->offset;
+            return 0;
+        }
+
+        /* drop the fetch and start over at the new position */
+        fetch_cancel (data);
+        data->sequential = 0;
+
+        data->requests ++;
+        g_seekable_seek (data->seekable, offset, gwhence, NULL, & error);
+        CHECK_ERROR ("seek within", vfs_get_filename (file));
+
+        data->stream_pos = g_seekable_tell (data->seekable);
+        chunk->offset = data->stream_pos;
+        chunk->len = 0;
+        data->cur_pos = 0;
+        return 0;
+    }
+
+    data->requests ++;
     g_seekable_seek (data->seekable, offset, gwhence, NULL, & error);
     CHECK_ERROR ("seek within", vfs_get_filename (file));
 
@@ -229,17 +511,34 @@ FAILED:
 static int64_t gio_ftell (VFSFile * file)
 {
     FileData * data = vfs_get_handle (file);
+
+    if (data->readahead)
+        return data->chunks[data->cur].offset + data->cur_pos;
+
     return g_seekable_tell (data->seekable);
 }
 
 static int gio_getc (VFSFile * file)
 {
+    FileData * data = vfs_get_handle (file);
     unsigned char c;
+
+    if (data->readahead && data->cur_pos < data->chunks[data->cur].len)
+        return (unsigned char) data->chunks[data->cur].data[data->cur_pos ++];
+
     return (gio_fread (& c, 1, 1, file) == 1) ? c : -1;
 }
 
 static int gio_ungetc (int c, VFSFile * file)
 {
+    FileData * data = vfs_get_handle (file);
+
+    if (data->readahead && data->cur_pos > 0)
+    {
+        data->cur_pos --;
+        return c;
+    }
+
     return (! gio_fseek (file, -1, SEEK_CUR)) ? c : -1;
 }
 
@@ -298,6 +597,21 @@ FAILED:
     return -1;
 }
 
+static char * gio_get_metadata (VFSFile * file, const char * field)
+{
+    FileData * data = vfs_get_handle (file);
+
+    if (! strcmp (field, "read-requests") || ! strcmp (field, "io-requests"))
+    {
+        if (data->readahead)
+            fetch_wait (data);
+
+        return g_strdup_printf ("%" G_GINT64_FORMAT, data->requests);
+    }
+
+    return 0;
+}
+
 static const char gio_about[] =
  N_("GIO Plugin for Audacious\n"
     "Copyright 2009-2012 John Lindgren");
@@ -316,7 +630,8 @@ static VFSConstructor constructor = {
     .vfs_ftell_impl = gio_ftell,
     .vfs_feof_impl = gio_feof,
     .vfs_ftruncate_impl = gio_ftruncate,
-    .vfs_fsize_impl = gio_fsize
+    .vfs_fsize_impl = gio_fsize,
+    .vfs_get_metadata_impl = gio_get_metadata
 };
 
 AUD_TRANSPORT_PLUGIN
@@ -0,0 +1,366 @@
+/*
+ * Index files kept by input plugins under the user directory
+ * Copyright 2012 Audacious development team
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Several input plugins remember what they learned about a file while playing
+ * it (seek points, frame indexes, exact lengths) in a small file under
+ * <user dir>/<plugin>-index, named after a hash of the URI.  This header holds
+ * the parts they have in common:
+ *
+ * - Every index file starts with an IndexFileHeader followed by the URI.  An
+ *   index only applies to a file of the same URI and size and, for local
+ *   files, the same modification time.  Other files have no usable
+ *   modification time; plugins must check their data against the file before
+ *   trusting it (see index_file_has_sync).
+ * - Files are written under a temporary name and renamed into place.
+ * - Loading an index touches it.  Once there are more than INDEX_FILE_MAX
+ *   index files, the least recently used ones are deleted, down to
+ *   INDEX_FILE_KEEP.  The directory is scanned for that when the first new file
+ *   of a session is created, and after that only when the count of files
+ *   created since crosses the limit.
+ *
+ * The plugins are built separately, so this is a header of static functions,
+ * to be included by the one source file of a plugin that handles its index. */
+
+#ifndef AUD_INDEX_FILE_H
+#define AUD_INDEX_FILE_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <audacious/debug.h>
+#include <audacious/misc.h>
+#include <libaudcore/audstrings.h>
+#include <libaudcore/vfs.h>
+
+#define INDEX_FILE_MAX 1000
+#define INDEX_FILE_KEEP 900
+
+typedef struct {
+    char magic[8];
+    int64_t size;
+    int64_t mtime;      /* 0 if the file is not local */
+    int32_t name_len;
+    int32_t reserved;
+} IndexFileHeader;
+
+typedef struct {
+    FILE * handle;
+    char * path;
+    bool_t local;       /* identified by modification time */
+} IndexFile;
+
+/* sorts by time of last use */
+typedef struct {
+    time_t used;
+    char * name;
+} IndexFileEntry;
+
+static pthread_mutex_t index_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int index_file_count = -1;   /* files in the directory, -1 if unknown */
+
+static bool_t index_file_identity (const char * filename, VFSFile * file,
+ int64_t * size, int64_t * mtime)
+{
+    if (vfs_is_streaming (file) || (* size = vfs_fsize (file)) <= 0)
+        return FALSE;
+
+    * mtime = 0;
+
+    if (! strncmp (filename, "file://", 7))
+    {
+        char * local = uri_to_filename (filename);
+        struct stat st;
+
+        if (! local)
+            return FALSE;
+
+        bool_t ok = ! stat (local, & st);
+        free (local);
+
+        if (! ok)
+            return FALSE;
+
+        * mtime = st.st_mtime;
+    }
+
+    return TRUE;
+}
+
+static char * index_file_path (const char * dir_name, const char * filename,
+ bool_t create)
+{
+    const char * user_dir = aud_get_path (AUD_PATH_USER_DIR);
+    uint64_t hash = 0xcbf29ce484222325ULL;  /* FNV-1a */
+
+    for (const unsigned char * c = (const unsigned char *) filename; * c; c ++)
+        hash = (hash ^ * c) * 0x100000001b3ULL;
+
+    int dir_len = strlen (user_dir) + 1 + strlen (dir_name);
+    char * path = malloc (dir_len + 1 + 16 + 1);
+
+    snprintf (path, dir_len + 1, "%s/%s", user_dir, dir_name);
+
+    if (create && mkdir (path, 0700) < 0 && errno != EEXIST)
+    {
+        AUDDBG ("Cannot create %s: %s.\n", path, strerror (errno));
+        free (path);
+        return NULL;
+    }
+
+    snprintf (path + dir_len, 1 + 16 + 1, "/%016llx", (unsigned long long) hash);
+    return path;
+}
+
+static int index_file_compare (const void * a, const void * b)
+{
+    time_t x = ((const IndexFileEntry *) a)->used;
+    time_t y = ((const IndexFileEntry *) b)->used;
+
+    return (x > y) - (x < y);
+}
+
+/* If a directory holds more than INDEX_FILE_MAX files, deletes the least
+ * recently used ones, leaving INDEX_FILE_KEEP.  Returns the number of files
+ * left. */
+static int index_file_prune (const char * dir)
+{
+    DIR * handle = opendir (dir);
+    IndexFileEntry * files = NULL;
+    int count = 0, size = 0;
+    struct dirent * entry;
+
+    if (! handle)
+        return 0;
+
+    while ((entry = readdir (handle)))
+    {
+        char path[strlen (dir) + 1 + strlen (entry->d_name) + 1];
+        struct stat st;
+
+        snprintf (path, sizeof path, "%s/%s", dir, entry->d_name);
+
+        if (entry->d_name[0] == '.' || stat (path, & st) < 0 ||
+         ! S_ISREG (st.st_mode))
+            continue;
+
+        if (count == size)
+        {
+            size = size ? size * 2 : 256;
+            files = realloc (files, sizeof (IndexFileEntry) * size);
+        }
+
+        files[count].used = st.st_mtime;
+        files[count].name = strdup (entry->d_name);
+        count ++;
+    }
+
+    closedir (handle);
+
+    int left = count;
+
+    if (count > INDEX_FILE_MAX)
+    {
+        qsort (files, count, sizeof (IndexFileEntry), index_file_compare);
+
+        for (int i = 0; i < count - INDEX_FILE_KEEP; i ++)
+        {
+            char path[strlen (dir) + 1 + strlen (files[i].name) + 1];
+
+            snprintf (path, sizeof path, "%s/%s", dir, files[i].name);
+
+            if (! unlink (path))
+                left --;
+        }
+
+        AUDDBG ("Removed %d old index files from %s.\n", count - left, dir);
+    }
+
+    for (int i = 0; i < count; i ++)
+        free (files[i].name);
+
+    free (files);
+    return left;
+}
+
+/* Opens the index of a file for reading.  On success, the plugin's own data
+ * follows at the position of f->handle; the index must then be closed with
+ * index_file_close. */
+static bool_t index_file_open (IndexFile * f, const char * dir_name,
+ const char * magic, const char * filename, VFSFile * file)
+{
+    IndexFileHeader header;
+    int64_t size, mtime;
+    int name_len = strlen (filename);
+    char name[name_len];
+
+    memset (f, 0, sizeof (IndexFile));
+
+    if (! index_file_identity (filename, file, & size, & mtime) || ! (f->path =
+     index_file_path (dir_name, filename, FALSE)))
+        return FALSE;
+
+    if (! (f->handle = fopen (f->path, "rb")))
+        goto FAIL;
+
+    if (fread (& header, sizeof header, 1, f->handle) != 1 || memcmp
+     (header.magic, magic, 8) || header.size != size || header.mtime != mtime ||
+     header.name_len != name_len || fread (name, 1, name_len, f->handle) !=
+     name_len || memcmp (name, filename, name_len))
+        goto FAIL;
+
+    f->local = (mtime != 0);
+    return TRUE;
+
+FAIL:
+    if (f->handle)
+        fclose (f->handle);
+
+    free (f->path);
+    memset (f, 0, sizeof (IndexFile));
+    return FALSE;
+}
+
+/* Closes an index opened for reading.  If it was used, its time of last use
+ * is updated. */
+static void index_file_close (IndexFile * f, bool_t used)
+{
+    fclose (f->handle);
+
+    if (used)
+        utime (f->path, NULL);
+
+    free (f->path);
+    memset (f, 0, sizeof (IndexFile));
+}
+
+/* Starts writing the index of a file.  The plugin writes its own data to
+ * f->handle and then calls index_file_commit. */
+static bool_t index_file_create (IndexFile * f, const char * dir_name,
+ const char * magic, const char * filename, VFSFile * file)
+{
+    IndexFileHeader header;
+    int name_len = strlen (filename);
+
+    memset (f, 0, sizeof (IndexFile));
+    memset (& header, 0, sizeof header);
+
+    if (! index_file_identity (filename, file, & header.size, & header.mtime) ||
+     ! (f->path = index_file_path (dir_name, filename, TRUE)))
+        return FALSE;
+
+    char temp[strlen (f->path) + 5];
+    snprintf (temp, sizeof temp, "%s.tmp", f->path);
+
+    memcpy (header.magic, magic, 8);
+    header.name_len = name_len;
+
+    if (! (f->handle = fopen (temp, "wb")))
+    {
+        AUDDBG ("Cannot write %s: %s.\n", temp, strerror (errno));
+        free (f->path);
+        memset (f, 0, sizeof (IndexFile));
+        return FALSE;
+    }
+
+    if (fwrite (& header, sizeof header, 1, f->handle) != 1 || fwrite
+     (filename, 1, name_len, f->handle) != name_len)
+        AUDDBG ("Cannot write %s: %s.\n", temp, strerror (errno));
+
+    f->local = (header.mtime != 0);
+    return TRUE;
+}
+
+/* Finishes writing an index.  If ok is FALSE or anything failed, the index
+ * is discarded.  Returns TRUE if it was saved. */
+static bool_t index_file_commit (IndexFile * f, bool_t ok)
+{
+    char temp[strlen (f->path) + 5];
+    struct stat st;
+
+    snprintf (temp, sizeof temp, "%s.tmp", f->path);
+
+    ok = (! ferror (f->handle) && ok);
+    ok = (! fclose (f->handle) && ok);
+
+    bool_t is_new = (stat (f->path, & st) < 0);
+
+    if (! ok || rename (temp, f->path) < 0)
+    {
+        if (ok)
+            AUDDBG ("Cannot write %s: %s.\n", f->path, strerror (errno));
+
+        unlink (temp);
+        free (f->path);
+        memset (f, 0, sizeof (IndexFile));
+        return FALSE;
+    }
+
+    if (is_new)
+    {
+        pthread_mutex_lock (& index_file_mutex);
+
+        if (index_file_count < 0 || ++ index_file_count > INDEX_FILE_MAX)
+        {
+            * strrchr (f->path, '/') = 0;
+            index_file_count = index_file_prune (f->path);
+        }
+
+        pthread_mutex_unlock (& index_file_mutex);
+    }
+
+    free (f->path);
+    memset (f, 0, sizeof (IndexFile));
+    return TRUE;
+}
+
+/* Checks whether the bytes at the given offset of a file match a sync word,
+ * comparing only the bits set in mask.  The file position is restored. */
+static bool_t index_file_has_sync (VFSFile * file, int64_t offset,
+ const unsigned char * sync, const unsigned char * mask, int len)
+{
+    int64_t pos = vfs_ftell (file);
+    unsigned char b[len];
+    bool_t found = FALSE;
+
+    if (! vfs_fseek (file, offset, SEEK_SET) && vfs_fread (b, 1, len, file) ==
+     len)
+    {
+        found = TRUE;
+
+        for (int i = 0; i < len; i ++)
+        {
+            if ((b[i] & mask[i]) != sync[i])
+                found = FALSE;
+        }
+    }
+
+    if (pos >= 0)
+        vfs_fseek (file, pos, SEEK_SET);
+
+    return found;
+}
+
+#endif /* AUD_INDEX_FILE_H */
@@ -24,7 +24,9 @@
 #include "config.h"
 
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include <mpg123.h>
 
@@ -40,6 +42,8 @@
 #include <audacious/plugin.h>
 #include <audacious/audtag.h>
 
+#include "seekindex.h"
+
 /* Define to read all frame headers when calculating file length */
 /* #define FULL_SCAN */
 
@@ -94,6 +98,144 @@ static void make_format_string (const struct mpg123_frameinfo * info, char *
 	snprintf (buf, bsize, "MPEG-%s layer %d", vers[info->version], info->layer);
 }
 
+/* Fast probe: instead of decoding audio, look for a run of consecutive MPEG
+ * frame headers that agree on version, layer and sample rate.  Only if no such
+ * run turns up near the start of the file do we fall back to decoding. */
+
+#define PROBE_BUFSIZE 16384
+#define PROBE_STREAM_SIZE 4096  /* about one second at 32 kbps */
+#define PROBE_FRAMES 4        /* consecutive frames needed */
+#define PROBE_FRAMES_XING 2   /* ... if the first one is a Xing/Info/VBRI frame */
+
+typedef struct {
+	int version;  /* 0 = MPEG-1, 1 = MPEG-2, 2 = MPEG-2.5 */
+	int layer;
+	int rate;
+	int channels;
+	int size;     /* in bytes, including the header */
+} FrameHeader;
+
+static bool_t parse_frame_header (const unsigned char * b, FrameHeader * h)
+{
+	static const short bitrates[2][3][15] = {
+		{{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+		 {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+		 {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}},
+		{{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+		 {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+		 {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}}};
+	static const int rates[3] = {44100, 48000, 32000};
+
+	if (b[0] != 0xff || (b[1] & 0xe0) != 0xe0)
+		return FALSE;
+
+	int version_bits = (b[1] >> 3) & 3;
+	int layer_bits = (b[1] >> 1) & 3;
+	int bitrate_index = b[2] >> 4;
+	int rate_index = (b[2] >> 2) & 3;
+	int padding = (b[2] >> 1) & 1;
+
+	/* reserved values; free format is left to the decoder */
+	if (version_bits == 1 || layer_bits == 0 || bitrate_index == 0 ||
+	 bitrate_index == 15 || rate_index == 3 || (b[3] & 3) == 2)
+		return FALSE;
+
+	h->version = (version_bits == 3) ? 0 : (version_bits == 2) ? 1 : 2;
+	h->layer = 4 - layer_bits;
+	h->rate = rates[rate_index] >> h->version;
+	h->channels = ((b[3] >> 6) == 3) ? 1 : 2;
+
+	int bitrate = bitrates[h->version ? 1 : 0][h->layer - 1][bitrate_index] * 1000;
+
+	if (h->layer == 1)
+		h->size = (12 * bitrate / h->rate + padding) * 4;
+	else if (h->layer == 3 && h->version)
+		h->size = 72 * bitrate / h->rate + padding;
+	else
+		h->size = 144 * bitrate / h->rate + padding;
+
+	return TRUE;
+}
+
+/* Xing/Info (LAME) frames carry their tag after the side info, VBRI frames
+ * (Fraunhofer) at a fixed offset of 32 bytes. */
+static bool_t is_vbr_info_frame (const unsigned char * b, const FrameHeader * h,
+ int avail)
+{
+	static const int side_info[2][2] = {{17, 32}, {9, 17}};
+	int offset = 4 + side_info[h->version ? 1 : 0][h->channels - 1];
+
+	if (h->layer != 3)
+		return FALSE;
+
+	if (offset + 4 <= avail && (! memcmp (b + offset, "Xing", 4) ||
+	 ! memcmp (b + offset, "Info", 4)))
+		return TRUE;
+
+	return (36 + 4 <= avail && ! memcmp (b + 36, "VBRI", 4));
+}
+
+/* Returns 1 if a run of matching frame headers is found, 0 if not. */
+static int probe_headers (VFSFile * file)
+{
+	unsigned char buf[PROBE_BUFSIZE];
+	int len = vfs_fread (buf, 1, 10, file);
+
+	/* skip an ID3v2 tag, which may hold large pictures */
+	if (len == 10 && ! memcmp (buf, "ID3", 3))
+	{
+		int64_t skip = ((buf[6] & 0x7f) << 21) | ((buf[7] & 0x7f) << 14) |
+		 ((buf[8] & 0x7f) << 7) | (buf[9] & 0x7f);
+
+		if (buf[5] & 0x10)
+			skip += 10;  /* footer */
+
+		if (vfs_is_streaming (file) || vfs_fseek (file, skip, SEEK_CUR) < 0)
+		{
+			while (skip > 0 && (len = vfs_fread (buf, 1, MIN (skip,
+			 PROBE_BUFSIZE), file)) > 0)
+				skip -= len;
+
+			if (skip > 0)
+				return 0;
+		}
+
+		len = 0;
+	}
+
+	/* A stream delivers data no faster than its bitrate, so filling the whole
+	 * buffer could take seconds; a short read has to do.  If it holds too few
+	 * frames, the decoder fallback reads on. */
+	int want = vfs_is_streaming (file) ? PROBE_STREAM_SIZE : PROBE_BUFSIZE;
+
+	len += vfs_fread (buf + len, 1, want - len, file);
+
+	for (int start = 0; start + 4 <= len; start ++)
+	{
+		FrameHeader first, h;
+
+		if (! parse_frame_header (buf + start, & first))
+			continue;
+
+		int needed = is_vbr_info_frame (buf + start, & first, len - start) ?
+		 PROBE_FRAMES_XING : PROBE_FRAMES;
+		int pos = start, found = 0;
+
+		while (found < needed && pos + 4 <= len && parse_frame_header (buf +
+		 pos, & h) && h.version == first.version && h.layer == first.layer &&
+		 h.rate == first.rate)
+		{
+			found ++;
+			pos += h.size;
+		}
+
+		if (found >= needed)
+			return 1;
+	}
+
+	return 0;
+}
+
 static bool_t mpg123_probe_for_fd (const char * fname, VFSFile * file)
 {
 	if (! file)
@@ -105,6 +247,17 @@ static bool_t mpg123_probe_for_fd (const char * fname, VFSFile * file)
 	if (! strncmp (fname, "mms://", 6))
 		return FALSE;
 
+	if (probe_headers (file))
+	{
+		AUDDBG ("Accepted by frame headers: %s.\n", fname);
+		return TRUE;
+	}
+
+	/* Not conclusive (junk before the first frame, free format, very short
+	 * file ...); let the decoder decide. */
+	if (vfs_fseek (file, 0, SEEK_SET) < 0 && ! vfs_is_streaming (file))
+		return FALSE;
+
 	mpg123_handle * dec = mpg123_new (NULL, NULL);
 	mpg123_param (dec, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
 
@@ -200,14 +353,18 @@ static Tuple * mpg123_probe_for_tuple (const char * filename, VFSFile * file)
 
 	if (! stream)
 	{
+		SeekIndex index;
 		int64_t size = vfs_fsize (file);
-		int64_t samples = mpg123_length (decoder);
+		int64_t samples = seek_index_load (filename, file, & index) ?
+		 index.samples : mpg123_length (decoder);
 		int length = (samples > 0 && rate > 0) ? samples * 1000 / rate : 0;
 
 		if (length > 0)
 			tuple_set_int (tuple, FIELD_LENGTH, NULL, length);
 		if (size > 0 && length > 0)
 			tuple_set_int (tuple, FIELD_BITRATE, NULL, 8 * size / length);
+
+		seek_index_free (& index);
 	}
 
 	mpg123_delete (decoder);
@@ -226,8 +383,17 @@ ERR:
 	return NULL;
 }
 
+#define DECODE_BUFFERS 8
+
+typedef struct {
+	float data[8192];
+	size_t size;
+	int bitrate;
+} DecodeBuffer;
+
 typedef struct {
 	VFSFile *fd;
+	const char *filename;
 	mpg123_handle *decoder;
 	long rate;
 	int channels;
@@ -235,7 +401,21 @@ typedef struct {
 	int64_t seek;
 	bool_t stop;
 	bool_t stream;
+	bool_t indexed;
 	Tuple *tu;
+
+	/* decode-ahead queue, protected by qlock */
+	pthread_mutex_t qlock;
+	pthread_cond_t qcond;
+	DecodeBuffer *bufs;
+	int qhead, qcount;
+	bool_t busy;          /* decode thread is inside mpg123_read */
+	bool_t paused;        /* seek pending, decode thread must not run */
+	bool_t ended;
+	bool_t decode_error;
+	bool_t quit;
+	bool_t tuple_changed; /* stream metadata updated, not yet passed on */
+	int64_t idle_time;    /* microseconds the decode thread waited */
 } MPG123PlaybackContext;
 
 static char *
@@ -279,15 +459,132 @@ static Tuple * get_stream_tuple (InputPlayback * p, const char * filename,
 	return tuple;
 }
 
-static void update_stream_tuple (InputPlayback * p, VFSFile * file,
- Tuple * tuple)
+/* Having decoded to the end, libmpg123 has seen every frame header; keep its
+ * frame index for the next time the file is opened. */
+static void save_index (const char * filename, VFSFile * file,
+ mpg123_handle * decoder)
+{
+	off_t * offsets, step;
+	size_t fill;
+
+	if (mpg123_index (decoder, & offsets, & step, & fill) == MPG123_OK)
+		seek_index_save (filename, file, mpg123_tell (decoder), offsets, step,
+		 fill);
+}
+
+static int64_t time_usec (void)
+{
+	struct timeval tv;
+	gettimeofday (& tv, NULL);
+	return (int64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Decode-ahead thread.  It fills free buffers from the pool until the queue is
+ * full, then sleeps; the playback thread only hands finished buffers to the
+ * output.  While a seek is pending (ctx->paused) the decoder stays parked so
+ * that the playback thread can use the mpg123 handle.  Apart from that, this
+ * is the only thread using the file, so stream metadata is read here too. */
+static void * decode_worker (void * arg)
 {
-	if (update_stream_metadata (file, "track-name", tuple, FIELD_TITLE) ||
-	 update_stream_metadata (file, "stream-name", tuple, FIELD_ARTIST))
+	MPG123PlaybackContext * ctx = arg;
+	int error_count = 0;
+
+	pthread_mutex_lock (& ctx->qlock);
+
+	while (1)
 	{
-		tuple_ref (tuple);
-		p->set_tuple (p, tuple);
+		if (! ctx->quit && (ctx->paused || ctx->ended || ctx->qcount ==
+		 DECODE_BUFFERS))
+		{
+			int64_t idle_start = time_usec ();
+			pthread_cond_wait (& ctx->qcond, & ctx->qlock);
+			ctx->idle_time += time_usec () - idle_start;
+			continue;
+		}
+
+		if (ctx->quit)
+			break;
+
+		DecodeBuffer * buf = & ctx->bufs[(ctx->qhead + ctx->qcount) %
+		 DECODE_BUFFERS];
+		struct mpg123_frameinfo fi;
+
+		ctx->busy = TRUE;
+		pthread_mutex_unlock (& ctx->qlock);
+
+		int ret = mpg123_read (ctx->decoder, (void *) buf->data, sizeof
+		 buf->data, & buf->size);
+
+		if (ret == MPG123_DONE && ! ctx->stream && ! ctx->indexed)
+			save_index (ctx->filename, ctx->fd, ctx->decoder);
+
+		if (ret >= 0)
+		{
+			mpg123_info (ctx->decoder, & fi);
+			buf->bitrate = fi.bitrate;
+		}
+
+		bool_t tuple_changed = (ctx->stream && ret >= 0 &&
+		 (update_stream_metadata (ctx->fd, "track-name", ctx->tu, FIELD_TITLE)
+		 || update_stream_metadata (ctx->fd, "stream-name", ctx->tu,
+		 FIELD_ARTIST)));
+
+		pthread_mutex_lock (& ctx->qlock);
+		ctx->busy = FALSE;
+
+		if (tuple_changed)
+			ctx->tuple_changed = TRUE;
+
+		if (ctx->paused)
+			;  /* seek pending; the result is stale */
+		else if (ret == MPG123_DONE || ret == MPG123_ERR_READER)
+			ctx->ended = TRUE;
+		else if (ret < 0)
+		{
+			fprintf (stderr, "mpg123 error in %s: %s\n", ctx->filename,
+			 mpg123_strerror (ctx->decoder));
+
+			if (++ error_count >= 10)
+				ctx->ended = ctx->decode_error = TRUE;
+		}
+		else
+		{
+			error_count = 0;
+			ctx->qcount ++;
+		}
+
+		pthread_cond_broadcast (& ctx->qcond);
 	}
+
+	pthread_mutex_unlock (& ctx->qlock);
+	return NULL;
+}
+
+/* Runs on the playback thread, with the global mutex held. */
+static bool_t decode_seek (MPG123PlaybackContext * ctx, int64_t sample)
+{
+	pthread_mutex_lock (& ctx->qlock);
+
+	ctx->paused = TRUE;
+	while (ctx->busy)
+		pthread_cond_wait (& ctx->qcond, & ctx->qlock);
+
+	bool_t ok = (mpg123_seek (ctx->decoder, sample, SEEK_SET) >= 0);
+
+	if (! ok)
+		fprintf (stderr, "mpg123 error in %s: %s\n", ctx->filename,
+		 mpg123_strerror (ctx->decoder));
+
+	/* drop everything decoded before the seek, even if it failed, so that
+	 * the output does not restart with stale audio */
+	ctx->qhead = ctx->qcount = 0;
+	ctx->ended = FALSE;
+	ctx->paused = FALSE;
+
+	pthread_cond_broadcast (& ctx->qcond);
+	pthread_mutex_unlock (& ctx->qlock);
+
+	return ok;
 }
 
 static bool_t mpg123_playback_worker (InputPlayback * data, const char *
@@ -302,13 +599,14 @@ static bool_t mpg123_playback_worker (InputPlayback * data, const char *
 	int bitrate = 0, bitrate_sum = 0, bitrate_count = 0;
 	int bitrate_updated = -1000; /* >= a second away from any position */
 	struct mpg123_frameinfo fi;
-	int error_count = 0;
+	pthread_t decode_thread;
 
 	memset(&ctx, 0, sizeof(MPG123PlaybackContext));
 	memset(&fi, 0, sizeof(struct mpg123_frameinfo));
 
 	AUDDBG("playback worker started for %s\n", filename);
 	ctx.fd = file;
+	ctx.filename = filename;
 
 	AUDDBG ("Checking for streaming ...\n");
 	ctx.stream = vfs_is_streaming (file);
@@ -316,12 +614,18 @@ static bool_t mpg123_playback_worker (InputPlayback * data, const char *
 
 	ctx.seek = (start_time > 0) ? start_time : -1;
 	ctx.stop = FALSE;
+
+	pthread_mutex_init (& ctx.qlock, NULL);
+	pthread_cond_init (& ctx.qcond, NULL);
+	ctx.bufs = malloc (sizeof (DecodeBuffer) * DECODE_BUFFERS);
+
 	data->set_data (data, & ctx);
 
 	ctx.decoder = mpg123_new (NULL, NULL);
 	mpg123_param (ctx.decoder, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
 	mpg123_param (ctx.decoder, MPG123_ADD_FLAGS, MPG123_GAPLESS, 0);
 	mpg123_param (ctx.decoder, MPG123_ADD_FLAGS, MPG123_SEEKBUFFER, 0);
+	mpg123_param (ctx.decoder, MPG123_INDEX_SIZE, SEEK_INDEX_SIZE, 0);
 
 	if (ctx.stream)
 		mpg123_replace_reader_handle (ctx.decoder, replace_read, replace_lseek_dummy, NULL);
@@ -339,21 +643,33 @@ OPEN_ERROR:
 		goto cleanup;
 	}
 
-	float outbuf[8192];
-	size_t outbuf_size = 0;
+	/* a saved index makes seeking exact without scanning the file */
+	if (! ctx.stream)
+	{
+		SeekIndex index;
+
+		if (seek_index_load (filename, file, & index))
+		{
+			ctx.indexed = (mpg123_set_index (ctx.decoder, index.offsets,
+			 index.step, index.fill) == MPG123_OK);
+			seek_index_free (& index);
+		}
+	}
 
 #ifdef FULL_SCAN
 	if (mpg123_scan (ctx.decoder) < 0)
 		goto OPEN_ERROR;
 #endif
 
+	/* the first buffer is decoded here to learn the output format; it goes
+	 * into the queue ahead of everything the decode thread produces */
 GET_FORMAT:
 	if (mpg123_getformat (ctx.decoder, & ctx.rate, & ctx.channels,
 	 & ctx.encoding) < 0)
 		goto OPEN_ERROR;
 
-	while ((ret = mpg123_read (ctx.decoder, (void *) outbuf, sizeof outbuf,
-	 & outbuf_size)) < 0)
+	while ((ret = mpg123_read (ctx.decoder, (void *) ctx.bufs[0].data,
+	 sizeof ctx.bufs[0].data, & ctx.bufs[0].size)) < 0)
 	{
 		if (ret == MPG123_NEW_FORMAT)
 			goto GET_FORMAT;
@@ -363,6 +679,9 @@ GET_FORMAT:
 	if (mpg123_info (ctx.decoder, & fi) < 0)
 		goto OPEN_ERROR;
 
+	ctx.bufs[0].bitrate = fi.bitrate;
+	ctx.qcount = 1;
+
 	bitrate = fi.bitrate * 1000;
 	data->set_params (data, bitrate, ctx.rate, ctx.channels);
 
@@ -379,6 +698,8 @@ GET_FORMAT:
 
 	data->set_gain_from_playlist (data);
 
+	pthread_create (& decode_thread, NULL, decode_worker, & ctx);
+
 	pthread_mutex_lock (& mutex);
 
 	AUDDBG("starting decode\n");
@@ -388,6 +709,8 @@ GET_FORMAT:
 
 	int64_t frames_played = 0;
 	int64_t frames_total = (stop_time - start_time) * ctx.rate / 1000;
+	int64_t depth_sum = 0, depth_count = 0, underruns = 0;
+	int64_t play_start = time_usec ();
 
 	while (1)
 	{
@@ -401,17 +724,10 @@ GET_FORMAT:
 
 		if (ctx.seek >= 0)
 		{
-			if (mpg123_seek (ctx.decoder, (int64_t) ctx.seek * ctx.rate / 1000,
-			 SEEK_SET) < 0)
-			{
-				fprintf (stderr, "mpg123 error in %s: %s\n", filename,
-				 mpg123_strerror (ctx.decoder));
-			}
-			else
+			if (decode_seek (& ctx, (int64_t) ctx.seek * ctx.rate / 1000))
 			{
 				data->output->flush (ctx.seek);
 				frames_played = (ctx.seek - start_time) * ctx.rate / 1000;
-				outbuf_size = 0;
 			}
 
             ctx.seek = -1;
@@ -419,8 +735,41 @@ GET_FORMAT:
 
 		pthread_mutex_unlock (& mutex);
 
-		mpg123_info(ctx.decoder, &fi);
-		bitrate_sum += fi.bitrate;
+		pthread_mutex_lock (& ctx.qlock);
+
+		depth_sum += ctx.qcount;
+		depth_count ++;
+
+		if (! ctx.qcount && ! ctx.ended)
+			underruns ++;
+
+		while (! ctx.qcount && ! ctx.ended && ! ctx.stop && ctx.seek < 0)
+			pthread_cond_wait (& ctx.qcond, & ctx.qlock);
+
+		DecodeBuffer * buf = ctx.qcount ? & ctx.bufs[ctx.qhead] : NULL;
+		bool_t ended = ctx.ended;
+		bool_t tuple_changed = ctx.tuple_changed;
+
+		ctx.tuple_changed = FALSE;
+
+		pthread_mutex_unlock (& ctx.qlock);
+
+		if (tuple_changed)
+		{
+			tuple_ref (ctx.tu);
+			data->set_tuple (data, ctx.tu);
+		}
+
+		if (! buf)
+		{
+			if (! ended)
+				continue;  /* interrupted by stop or seek */
+
+			error = ctx.decode_error;
+			goto decode_cleanup;
+		}
+
+		bitrate_sum += buf->bitrate;
 		bitrate_count ++;
 
 		if (bitrate_sum / bitrate_count != bitrate && abs
@@ -434,53 +783,50 @@ GET_FORMAT:
 			bitrate_updated = data->output->written_time ();
 		}
 
-		if (ctx.stream)
-			update_stream_tuple (data, file, ctx.tu);
+		bool_t stop = FALSE;
+		size_t size = buf->size;
 
-		if (! outbuf_size && (ret = mpg123_read (ctx.decoder, (void *) outbuf,
-		 sizeof outbuf, & outbuf_size)) < 0)
+		if (stop_time >= 0)
 		{
-			if (ret == MPG123_DONE || ret == MPG123_ERR_READER)
-				goto decode_cleanup;
-
-			fprintf (stderr, "mpg123 error in %s: %s\n", filename,
-			 mpg123_strerror (ctx.decoder));
+			int64_t remain = sizeof buf->data[0] * ctx.channels * (frames_total - frames_played);
+			remain = MAX (0, remain);
 
-			if (++ error_count >= 10)
+			if (size >= remain)
 			{
-				error = TRUE;
-				goto decode_cleanup;
+				size = remain;
+				stop = TRUE;
 			}
 		}
-		else
-		{
-			error_count = 0;
-
-			bool_t stop = FALSE;
 
-			if (stop_time >= 0)
-			{
-				int64_t remain = sizeof outbuf[0] * ctx.channels * (frames_total - frames_played);
-				remain = MAX (0, remain);
-
-				if (outbuf_size >= remain)
-				{
-					outbuf_size = remain;
-					stop = TRUE;
-				}
-			}
+		data->output->write_audio (buf->data, size);
+		frames_played += size / (sizeof buf->data[0] * ctx.channels);
 
-			data->output->write_audio (outbuf, outbuf_size);
-			frames_played += outbuf_size / (sizeof outbuf[0] * ctx.channels);
-			outbuf_size = 0;
+		/* give the buffer back to the decoder */
+		pthread_mutex_lock (& ctx.qlock);
+		ctx.qhead = (ctx.qhead + 1) % DECODE_BUFFERS;
+		ctx.qcount --;
+		pthread_cond_broadcast (& ctx.qcond);
+		pthread_mutex_unlock (& ctx.qlock);
 
-			if (stop)
-				goto decode_cleanup;
-		}
+		if (stop)
+			goto decode_cleanup;
 	}
 
 decode_cleanup:
 	AUDDBG("decode complete\n");
+
+	pthread_mutex_lock (& ctx.qlock);
+	ctx.quit = TRUE;
+	pthread_cond_broadcast (& ctx.qcond);
+	pthread_mutex_unlock (& ctx.qlock);
+
+	pthread_join (decode_thread, NULL);
+
+	AUDDBG ("Decode-ahead: average queue depth %.1f of %d buffers, %d underruns, "
+	 "decoder idle %d of %d ms.\n", depth_count ? (double) depth_sum /
+	 depth_count : 0.0, DECODE_BUFFERS, (int) underruns, (int) (ctx.idle_time /
+	 1000), (int) ((time_usec () - play_start) / 1000));
+
 	pthread_mutex_lock (& mutex);
 	data->set_data (data, NULL);
 	pthread_mutex_unlock (& mutex);
@@ -489,6 +835,11 @@ cleanup:
 	mpg123_delete(ctx.decoder);
 	if (ctx.tu)
 		tuple_unref (ctx.tu);
+
+	free (ctx.bufs);
+	pthread_cond_destroy (& ctx.qcond);
+	pthread_mutex_destroy (& ctx.qlock);
+
 	return ! error;
 }
 
@@ -499,7 +850,12 @@ static void mpg123_stop_playback_worker (InputPlayback * data)
 
 	if (context != NULL)
 	{
+		/* qlock too, in case the playback thread is waiting for the decoder */
+		pthread_mutex_lock (& context->qlock);
 		context->stop = TRUE;
+		pthread_cond_broadcast (& context->qcond);
+		pthread_mutex_unlock (& context->qlock);
+
 		data->output->abort_write ();
 	}
 
@@ -524,7 +880,11 @@ static void mpg123_seek_time (InputPlayback * data, int time)
 
 	if (context != NULL)
 	{
+		pthread_mutex_lock (& context->qlock);
 		context->seek = time;
+		pthread_cond_broadcast (& context->qcond);
+		pthread_mutex_unlock (& context->qlock);
+
 		data->output->abort_write ();
 	}
 
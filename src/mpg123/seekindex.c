@@ -0,0 +1,127 @@
+/*
+ * Persistent seek index for the mpg123 plugin
+ * Copyright (c) 2012 Audacious development team.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Persistent seek index.  VBR files without a Xing/VBRI table can only be
+ * seeked approximately unless every frame header is read first.  Once a file
+ * has been decoded to the end, libmpg123's frame index and the exact sample
+ * count are stored under the user directory (see index-file.h), so later opens
+ * get exact seeking and length for free. */
+
+#include "config.h"
+
+#include "../index-file/index-file.h"
+#include "seekindex.h"
+
+#define INDEX_DIR "mpg123-index"
+#define INDEX_MAGIC "AUDMPIX2"
+#define INDEX_MAX_FILL (1 << 20)
+
+typedef struct {
+	int64_t samples;
+	int64_t step;
+	int64_t fill;
+} IndexData;
+
+/* MPEG frame sync: eleven set bits */
+static const unsigned char frame_sync[2] = {0xff, 0xe0};
+
+bool_t seek_index_load (const char * filename, VFSFile * file, SeekIndex * index)
+{
+	IndexFile f;
+	IndexData data;
+	int64_t * raw = NULL;
+
+	memset (index, 0, sizeof (SeekIndex));
+
+	if (! index_file_open (& f, INDEX_DIR, INDEX_MAGIC, filename, file))
+		return FALSE;
+
+	if (fread (& data, sizeof data, 1, f.handle) != 1 || data.samples <= 0 ||
+	 data.step <= 0 || data.fill <= 0 || data.fill > INDEX_MAX_FILL)
+		goto FAIL;
+
+	raw = malloc (sizeof (int64_t) * data.fill);
+
+	if (fread (raw, sizeof (int64_t), data.fill, f.handle) != data.fill)
+		goto FAIL;
+
+	if (! f.local && ! (index_file_has_sync (file, raw[data.fill / 2],
+	 frame_sync, frame_sync, 2) && index_file_has_sync (file, raw[data.fill -
+	 1], frame_sync, frame_sync, 2)))
+	{
+		AUDDBG ("Seek index for %s does not match the file.\n", filename);
+		goto FAIL;
+	}
+
+	index_file_close (& f, TRUE);
+
+	index->samples = data.samples;
+	index->step = data.step;
+	index->fill = data.fill;
+	index->offsets = malloc (sizeof (off_t) * data.fill);
+
+	for (int i = 0; i < data.fill; i ++)
+		index->offsets[i] = raw[i];
+
+	free (raw);
+
+	AUDDBG ("Loaded seek index for %s: %d entries, step %d.\n", filename,
+	 (int) index->fill, (int) index->step);
+	return TRUE;
+
+FAIL:
+	index_file_close (& f, FALSE);
+	free (raw);
+	return FALSE;
+}
+
+void seek_index_save (const char * filename, VFSFile * file, int64_t samples,
+ const off_t * offsets, off_t step, size_t fill)
+{
+	IndexFile f;
+	IndexData data = {samples, step, fill};
+
+	if (samples <= 0 || ! offsets || step <= 0 || ! fill || fill > INDEX_MAX_FILL)
+		return;
+
+	if (! index_file_create (& f, INDEX_DIR, INDEX_MAGIC, filename, file))
+		return;
+
+	int64_t * raw = malloc (sizeof (int64_t) * fill);
+
+	for (int i = 0; i < fill; i ++)
+		raw[i] = offsets[i];
+
+	bool_t ok = (fwrite (& data, sizeof data, 1, f.handle) == 1 && fwrite (raw,
+	 sizeof (int64_t), fill, f.handle) == fill);
+
+	free (raw);
+
+	if (index_file_commit (& f, ok))
+		AUDDBG ("Saved seek index for %s: %d entries, step %d.\n", filename,
+		 (int) fill, (int) step);
+}
+
+void seek_index_free (SeekIndex * index)
+{
+	free (index->offsets);
+	memset (index, 0, sizeof (SeekIndex));
+}
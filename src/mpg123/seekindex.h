@@ -0,0 +1,47 @@
+/*
+ * Persistent seek index for the mpg123 plugin
+ * Copyright (c) 2012 Audacious development team.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MPG123_SEEKINDEX_H
+#define MPG123_SEEKINDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <libaudcore/vfs.h>
+
+/* Frame index of a file as built by libmpg123: offsets[i] is the byte
+ * position of frame i * step.  samples is the exact decoded length. */
+typedef struct {
+	int64_t samples;
+	off_t step;
+	size_t fill;
+	off_t * offsets;
+} SeekIndex;
+
+/* Frame index size requested from libmpg123 while building an index */
+#define SEEK_INDEX_SIZE 8192
+
+bool_t seek_index_load (const char * filename, VFSFile * file, SeekIndex * index);
+void seek_index_save (const char * filename, VFSFile * file, int64_t samples,
+ const off_t * offsets, off_t step, size_t fill);
+void seek_index_free (SeekIndex * index);
+
+#endif
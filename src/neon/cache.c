@@ -0,0 +1,270 @@
+/*
+ *  Sparse block cache for the neon HTTP transport
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "debug.h"
+
+#define NEON_CACHE_BLKSIZE  (64*1024)
+#define NEON_CACHE_SIZE     (32*1024*1024)   /* for all URLs together */
+#define NEON_CACHE_TTL      600              /* seconds */
+
+/*
+ * Each block holds one contiguous run [lo, hi) of valid bytes.
+ * Data that would leave a gap inside a block is not stored.
+ */
+struct cache_block {
+    gint lo;
+    gint hi;
+    gchar data[NEON_CACHE_BLKSIZE];
+};
+
+struct neon_cache {
+    gchar* url;
+    glong size;
+    time_t created;
+    time_t used;
+    gint refs;
+    gboolean listed;        /* TRUE while reachable through cache_table */
+    GHashTable* blocks;     /* block number -> struct cache_block */
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable* cache_table;    /* URL -> struct neon_cache */
+static glong cache_bytes;
+
+static void cache_free(struct neon_cache* c) {
+
+    cache_bytes -= (glong) g_hash_table_size(c->blocks) * NEON_CACHE_BLKSIZE;
+    g_hash_table_destroy(c->blocks);
+    g_free(c->url);
+    g_free(c);
+}
+
+/*
+ * Take an entry out of the table. It is freed as soon
+ * as the last handle using it lets go.
+ */
+static void cache_unlist(struct neon_cache* c) {
+
+    g_hash_table_remove(cache_table, c->url);
+    c->listed = FALSE;
+
+    if (0 == c->refs) {
+        cache_free(c);
+    }
+}
+
+/*
+ * Drop least recently used entries no handle is using
+ * until a new block fits. Return FALSE if it does not.
+ */
+static gboolean cache_make_room(void) {
+
+    while (cache_bytes + NEON_CACHE_BLKSIZE > NEON_CACHE_SIZE) {
+
+        GHashTableIter iter;
+        gpointer value;
+        struct neon_cache* oldest = NULL;
+
+        g_hash_table_iter_init(&iter, cache_table);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            struct neon_cache* c = value;
+
+            if ((0 == c->refs) && ((NULL == oldest) || (c->used < oldest->used))) {
+                oldest = c;
+            }
+        }
+
+        if (NULL == oldest) {
+            return FALSE;
+        }
+
+        _DEBUG("Evicting cached data of %s", oldest->url);
+        cache_unlist(oldest);
+    }
+
+    return TRUE;
+}
+
+/*
+ * -----
+ */
+
+struct neon_cache* neon_cache_get(const gchar* url, glong size) {
+
+    struct neon_cache* c;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&cache_mutex);
+
+    if (NULL == cache_table) {
+        cache_table = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    c = g_hash_table_lookup(cache_table, url);
+
+    if ((NULL != c) && ((c->size != size) || (now - c->created > NEON_CACHE_TTL))) {
+        _DEBUG("Cached data of %s is stale", url);
+        cache_unlist(c);
+        c = NULL;
+    }
+
+    if (NULL == c) {
+        c = g_new0(struct neon_cache, 1);
+        c->url = g_strdup(url);
+        c->size = size;
+        c->created = now;
+        c->listed = TRUE;
+        c->blocks = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+        g_hash_table_insert(cache_table, c->url, c);
+    }
+
+    c->refs++;
+    c->used = now;
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    return c;
+}
+
+/*
+ * -----
+ */
+
+void neon_cache_unref(struct neon_cache* c) {
+
+    pthread_mutex_lock(&cache_mutex);
+
+    c->refs--;
+    c->used = time(NULL);
+
+    if ((0 == c->refs) && !c->listed) {
+        cache_free(c);
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * Copy up to len cached bytes starting at pos into buf.
+ * Returns the number of bytes copied, which is 0 if the
+ * byte at pos is not in the cache.
+ */
+glong neon_cache_read(struct neon_cache* c, glong pos, void* buf, glong len) {
+
+    glong total = 0;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    while (len > 0) {
+        struct cache_block* b = g_hash_table_lookup(c->blocks, GINT_TO_POINTER(pos / NEON_CACHE_BLKSIZE));
+        gint off = pos % NEON_CACHE_BLKSIZE;
+        glong n;
+
+        if ((NULL == b) || (off < b->lo) || (off >= b->hi)) {
+            break;
+        }
+
+        n = MIN(len, b->hi - off);
+        memcpy((gchar *) buf + total, b->data + off, n);
+
+        pos += n;
+        len -= n;
+        total += n;
+
+        if (b->hi < NEON_CACHE_BLKSIZE) {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    return total;
+}
+
+/*
+ * Remember len bytes at buf as the content at pos.
+ */
+void neon_cache_write(struct neon_cache* c, glong pos, const void* buf, glong len) {
+
+    pthread_mutex_lock(&cache_mutex);
+
+    while (len > 0) {
+        gint idx = pos / NEON_CACHE_BLKSIZE;
+        gint off = pos % NEON_CACHE_BLKSIZE;
+        glong n = MIN(len, NEON_CACHE_BLKSIZE - off);
+        struct cache_block* b = g_hash_table_lookup(c->blocks, GINT_TO_POINTER(idx));
+
+        if (NULL == b) {
+            if (!cache_make_room()) {
+                break;
+            }
+
+            b = g_new(struct cache_block, 1);
+            b->lo = b->hi = off;
+            g_hash_table_insert(c->blocks, GINT_TO_POINTER(idx), b);
+            cache_bytes += NEON_CACHE_BLKSIZE;
+        }
+
+        if ((off >= b->lo) && (off <= b->hi) && (off + n > b->hi)) {
+            memcpy(b->data + off, buf, n);
+            b->hi = off + n;
+        }
+
+        pos += n;
+        len -= n;
+        buf = (const gchar *) buf + n;
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/*
+ * -----
+ */
+
+void neon_cache_cleanup(void) {
+
+    GHashTableIter iter;
+    gpointer value;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    if (NULL != cache_table) {
+        g_hash_table_iter_init(&iter, cache_table);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            struct neon_cache* c = value;
+
+            g_hash_table_iter_remove(&iter);
+            c->listed = FALSE;
+
+            if (0 == c->refs) {
+                cache_free(c);
+            }
+        }
+
+        g_hash_table_destroy(cache_table);
+        cache_table = NULL;
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+}
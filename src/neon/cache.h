@@ -0,0 +1,38 @@
+/*
+ *  Sparse block cache for the neon HTTP transport
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _NEON_CACHE_H
+#define _NEON_CACHE_H
+
+#include <glib.h>
+
+/*
+ * Data read from seekable HTTP resources is remembered per URL in
+ * fixed-size blocks, so that the probe/tuple/playback opens of a file
+ * and decoders jumping to its tail and back can be served without
+ * issuing new range requests.
+ */
+struct neon_cache;
+
+struct neon_cache* neon_cache_get(const gchar* url, glong size);
+void neon_cache_unref(struct neon_cache* c);
+glong neon_cache_read(struct neon_cache* c, glong pos, void* buf, glong len);
+void neon_cache_write(struct neon_cache* c, glong pos, const void* buf, glong len);
+void neon_cache_cleanup(void);
+
+#endif
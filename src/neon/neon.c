@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef DEBUG
 #define NEON_DEBUG
@@ -26,6 +27,7 @@
 
 #include "neon.h"
 
+#include <audacious/debug.h>
 #include <audacious/i18n.h>
 #include <audacious/misc.h>
 #include <audacious/plugin.h>
@@ -38,14 +40,153 @@
 #include <ne_auth.h>
 
 #include "config.h"
+#include "cache.h"
 #include "debug.h"
 #include "rb.h"
 #include "cert_verification.h"
 
-#define NEON_BUFSIZE        (128u*1024u)
+#define NEON_BUFSIZE        (128u*1024u)      /* initial ringbuffer size and fill limit */
+#define NEON_BUFSIZE_MIN    (32u*1024u)
+#define NEON_BUFSIZE_MAX    (1024u*1024u)     /* largest ringbuffer size */
+#define NEON_RATE_BYTES     (256*1024)        /* measure the network rate over this much data */
 #define NEON_NETBLKSIZE     (4096u)
+#define NEON_NETBLKSIZE_MAX (64u*1024u)
 #define NEON_ICY_BUFSIZE    (4096)
 #define NEON_RETRY_COUNT 6
+#define NEON_DRAIN_MAX (64 * 1024)
+#define NEON_POOL_SIZE      (8)
+
+/* Upper bounds of the read wait histogram buckets, in microseconds */
+static const gint64 wait_limits[NEON_WAIT_BUCKETS - 1] = {100, 1000, 10000, 100000, 1000000};
+
+#define NEON_POOL_TIMEOUT   (30)    /* seconds */
+#define NEON_POOL_REAP      (5)     /* seconds between checks for expiry */
+
+/*
+ * Sessions of closed handles are kept around for a while, so that the
+ * next open of a URL on the same server (the core probes, reads the
+ * tuple and then plays a file, opening it each time) can reuse the
+ * connection and TLS session instead of setting up new ones. While
+ * the pool is not empty, a main loop timer closes the sessions that
+ * have been idle for too long, so that no connection is held open
+ * once playback has stopped.
+ */
+struct pooled_session {
+    ne_session* session;
+    gchar* key;
+    time_t idle_since;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GList* pool;     /* Idle sessions, most recently used first */
+static guint pool_timer;
+
+static void pool_free(struct pooled_session* p) {
+    ne_session_destroy(p->session);
+    g_free(p->key);
+    g_free(p);
+}
+
+/* Call with pool_mutex held. */
+static void pool_reap(void) {
+
+    time_t now = time(NULL);
+    GList* node;
+    GList* next;
+
+    for (node = pool; NULL != node; node = next) {
+        struct pooled_session* p = node->data;
+        next = node->next;
+
+        if (now - p->idle_since >= NEON_POOL_TIMEOUT) {
+            pool = g_list_delete_link(pool, node);
+            pool_free(p);
+        }
+    }
+}
+
+static gboolean pool_reap_cb(gpointer unused) {
+
+    gboolean again;
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_reap();
+
+    if (!(again = (NULL != pool))) {
+        pool_timer = 0;
+    }
+
+    pthread_mutex_unlock(&pool_mutex);
+
+    return again;
+}
+
+static ne_session* pool_take(const gchar* key) {
+
+    ne_session* session = NULL;
+    GList* node;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    pool_reap();
+
+    for (node = pool; NULL != node; node = node->next) {
+        struct pooled_session* p = node->data;
+
+        if (!strcmp(p->key, key)) {
+            pool = g_list_delete_link(pool, node);
+            session = p->session;
+            g_free(p->key);
+            g_free(p);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pool_mutex);
+
+    return session;
+}
+
+static void pool_put(ne_session* session, const gchar* key) {
+
+    struct pooled_session* p = g_new(struct pooled_session, 1);
+    GList* last;
+
+    p->session = session;
+    p->key = g_strdup(key);
+    p->idle_since = time(NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+
+    pool_reap();
+    pool = g_list_prepend(pool, p);
+
+    if (g_list_length(pool) > NEON_POOL_SIZE) {
+        last = g_list_last(pool);
+        pool_free(last->data);
+        pool = g_list_delete_link(pool, last);
+    }
+
+    if (0 == pool_timer) {
+        pool_timer = g_timeout_add_seconds(NEON_POOL_REAP, pool_reap_cb, NULL);
+    }
+
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+static void pool_cleanup(void) {
+
+    pthread_mutex_lock(&pool_mutex);
+
+    if (0 != pool_timer) {
+        g_source_remove(pool_timer);
+        pool_timer = 0;
+    }
+
+    g_list_free_full(pool, (GDestroyNotify) pool_free);
+    pool = NULL;
+    pthread_mutex_unlock(&pool_mutex);
+}
 
 static gboolean neon_plugin_init(void) {
 
@@ -64,6 +205,8 @@ static gboolean neon_plugin_init(void) {
  */
 
 static void neon_plugin_fini(void) {
+    pool_cleanup();
+    neon_cache_cleanup();
     ne_sock_exit();
 }
 
@@ -81,7 +224,7 @@ static struct neon_handle* handle_init(void) {
     h->reader_status.reading = FALSE;
     h->reader_status.status = NEON_READER_INIT;
 
-    if (init_rb_with_lock(&(h->rb), NEON_BUFSIZE, &h->reader_status.mutex) != 0)
+    if (init_rb(&(h->rb), NEON_BUFSIZE) != 0)
     {
         _ERROR("Could not initialize buffer");
         g_free(h);
@@ -91,6 +234,11 @@ static struct neon_handle* handle_init(void) {
     h->purl = g_new0(ne_uri, 1);
     h->content_length = -1;
 
+    h->buffering.limit = NEON_BUFSIZE;
+    h->buffering.wanted = NEON_BUFSIZE;
+    h->buffering.blksize = NEON_NETBLKSIZE;
+    h->buffering.prebuffer = NEON_BUFSIZE / 2;
+
     return h;
 }
 
@@ -105,6 +253,10 @@ static void handle_free(struct neon_handle* h) {
     g_free(h->purl);
     destroy_rb(&h->rb);
 
+    if (NULL != h->cache) {
+        neon_cache_unref(h->cache);
+    }
+
     pthread_mutex_destroy(&h->reader_status.mutex);
     pthread_cond_destroy(&h->reader_status.cond);
 
@@ -112,6 +264,7 @@ static void handle_free(struct neon_handle* h) {
     g_free(h->icy_metadata.stream_title);
     g_free(h->icy_metadata.stream_url);
     g_free(h->icy_metadata.stream_contenttype);
+    g_free(h->session_key);
     g_free(h->url);
     g_free(h);
 }
@@ -254,7 +407,7 @@ static void kill_reader(struct neon_handle* h) {
 
 static int server_auth_callback(void* userdata, const char* realm, int attempt, char* username, char* password) {
 
-    struct neon_handle* h = (struct neon_handle*)userdata;
+    struct neon_handle* h = ne_get_session_private((ne_session*)userdata, "neon-handle");
     gchar* authcpy;
     gchar** authtok;
 
@@ -437,10 +590,15 @@ static int open_request(struct neon_handle* handle, gulong startbyte) {
     }
     ne_print_request_header(handle->request, "Icy-MetaData", "1");
 
+    pthread_mutex_lock(&handle->reader_status.mutex);
+    handle->stats.requests++;
+    pthread_mutex_unlock(&handle->reader_status.mutex);
+
     /*
      * Try to connect to the server.
      */
     _DEBUG("<%p> Connecting...", handle);
+    handle->conn_reusable = FALSE;
     ret = ne_begin_request(handle->request);
     status = ne_get_status(handle->request);
     _DEBUG("<%p> Return: %d, Status: %d", handle, ret, status->code);
@@ -458,7 +616,7 @@ static int open_request(struct neon_handle* handle, gulong startbyte) {
         /*
          * Redirect encountered. Reconnect.
          */
-        ne_end_request(handle->request);
+        handle->conn_reusable = (NE_OK == ne_end_request(handle->request));
         ret = NE_REDIRECT;
     }
 
@@ -480,7 +638,19 @@ static int open_request(struct neon_handle* handle, gulong startbyte) {
                 _DEBUG("<%p> URL opened OK", handle);
                 handle->content_start = startbyte;
                 handle->pos = startbyte;
+                handle->stream_pos = startbyte;
                 handle_headers(handle);
+
+                /*
+                 * Cache the data of seekable streams. ICY streams are
+                 * excluded since their data is interleaved with metadata.
+                 */
+                if ((NULL == handle->cache) && handle->can_ranges &&
+                    (-1 != handle->content_length) && (0 == handle->icy_metaint)) {
+                    handle->cache = neon_cache_get(handle->url,
+                     handle->content_start + handle->content_length);
+                }
+
                 return 0;
             }
             break;
@@ -517,6 +687,110 @@ static int open_request(struct neon_handle* handle, gulong startbyte) {
     return -1;
 }
 
+/*
+ * -----
+ */
+
+/*
+ * Sessions can only be shared between URLs that agree on
+ * everything the session was set up with.
+ */
+static gchar* session_key(struct neon_handle* handle, const gchar* proxy_host,
+ guint proxy_port, gboolean proxy_use_auth) {
+
+    return g_strdup_printf("%s://%s@%s:%u via %s:%u%s", handle->purl->scheme,
+     handle->purl->userinfo ? handle->purl->userinfo : "", handle->purl->host,
+     handle->purl->port, proxy_host ? proxy_host : "", proxy_port,
+     proxy_use_auth ? " (auth)" : "");
+}
+
+static ne_session* create_session(struct neon_handle* handle, const gchar* proxy_host,
+ guint proxy_port, gboolean proxy_use_auth) {
+
+    ne_session* session;
+
+    _DEBUG("<%p> Creating session to %s://%s:%d", handle, handle->purl->scheme, handle->purl->host, handle->purl->port);
+    session = ne_session_create(handle->purl->scheme, handle->purl->host, handle->purl->port);
+    ne_redirect_register(session);
+    ne_add_server_auth(session, NE_AUTH_BASIC, server_auth_callback, (void *)session);
+    ne_set_session_flag(session, NE_SESSFLAG_ICYPROTO, 1);
+    ne_set_session_flag(session, NE_SESSFLAG_PERSIST, 1);
+
+#ifdef HAVE_NE_SET_CONNECT_TIMEOUT
+    ne_set_connect_timeout(session, 10);
+#endif
+
+    ne_set_read_timeout(session, 10);
+    ne_set_useragent(session, "Audacious/" PACKAGE_VERSION );
+
+    if (proxy_host) {
+        _DEBUG("<%p> Using proxy: %s:%d", handle, proxy_host, proxy_port);
+        ne_session_proxy(session, proxy_host, proxy_port);
+
+        if (proxy_use_auth) {
+            _DEBUG("<%p> Using proxy authentication", handle);
+            ne_add_proxy_auth(session, NE_AUTH_BASIC, neon_proxy_auth_cb, (void *)session);
+        }
+    }
+
+    if (! strcmp("https", handle->purl->scheme)) {
+        ne_ssl_trust_default_ca(session);
+        ne_ssl_set_verify(session, neon_vfs_verify_environment_ssl_certs, session);
+    }
+
+    return session;
+}
+
+/*
+ * Read the rest of the current response and end the request, if no
+ * more than NEON_DRAIN_MAX bytes of it are left, so that the connection
+ * can carry the next request. Larger remainders are not worth reading;
+ * the connection is closed instead. The reader thread must be stopped.
+ */
+static void finish_request(struct neon_handle* h) {
+
+    glong remaining;
+
+    /* at NEON_READER_EOF, fill_buffer() has ended the request already */
+    if ((NULL == h->request) || (NEON_READER_EOF == h->reader_status.status) ||
+     (-1 == h->content_length) || (0 != h->icy_metaint)) {
+        return;
+    }
+
+    remaining = h->content_start + h->content_length - (h->stream_pos + used_rb(&h->rb));
+
+    if ((remaining < 0) || (remaining > NEON_DRAIN_MAX)) {
+        return;
+    }
+
+    _DEBUG("<%p> Discarding the last %ld bytes of the response", h, remaining);
+
+    if (NE_OK == ne_discard_response(h->request)) {
+        h->conn_reusable = (NE_OK == ne_end_request(h->request));
+    }
+}
+
+/*
+ * Hand the session of a handle back to the pool. The request must
+ * already have been destroyed. If its response was not read to the
+ * end (see finish_request()), the connection cannot carry another
+ * request and is closed; only the TLS session survives for resumption.
+ */
+static void release_session(struct neon_handle* handle) {
+
+    if (NULL == handle->session) {
+        return;
+    }
+
+    if (!handle->conn_reusable) {
+        ne_close_connection(handle->session);
+    }
+
+    ne_set_session_private(handle->session, "neon-handle", NULL);
+    pool_put(handle->session, handle->session_key);
+    handle->session = NULL;
+}
+
 /*
  * -----
  */
@@ -524,6 +798,7 @@ static int open_request(struct neon_handle* handle, gulong startbyte) {
 static gint open_handle(struct neon_handle* handle, gulong startbyte) {
 
     gint ret;
+    gchar* key;
     gchar* proxy_host = NULL;
     guint proxy_port = 0;
 
@@ -550,34 +825,18 @@ static gint open_handle(struct neon_handle* handle, gulong startbyte) {
             handle->purl->port = ne_uri_defaultport(handle->purl->scheme);
         }
 
-        _DEBUG("<%p> Creating session to %s://%s:%d", handle, handle->purl->scheme, handle->purl->host, handle->purl->port);
-        handle->session = ne_session_create(handle->purl->scheme, handle->purl->host, handle->purl->port);
-        ne_redirect_register(handle->session);
-        ne_add_server_auth(handle->session, NE_AUTH_BASIC, server_auth_callback, (void *)handle);
-        ne_set_session_flag(handle->session, NE_SESSFLAG_ICYPROTO, 1);
-        ne_set_session_flag(handle->session, NE_SESSFLAG_PERSIST, 0);
-
-#ifdef HAVE_NE_SET_CONNECT_TIMEOUT
-        ne_set_connect_timeout(handle->session, 10);
-#endif
-
-        ne_set_read_timeout(handle->session, 10);
-        ne_set_useragent(handle->session, "Audacious/" PACKAGE_VERSION );
+        key = session_key(handle, proxy_host, proxy_port, proxy_use_auth);
+        handle->session = pool_take(key);
 
-        if (use_proxy) {
-            _DEBUG("<%p> Using proxy: %s:%d", handle, proxy_host, proxy_port);
-            ne_session_proxy(handle->session, proxy_host, proxy_port);
-
-            if (proxy_use_auth) {
-                _DEBUG("<%p> Using proxy authentication", handle);
-                ne_add_proxy_auth(handle->session, NE_AUTH_BASIC, neon_proxy_auth_cb, (void *)handle);
-            }
+        if (NULL != handle->session) {
+            _DEBUG("<%p> Reusing session to %s://%s:%d", handle, handle->purl->scheme, handle->purl->host, handle->purl->port);
+        } else {
+            handle->session = create_session(handle, proxy_host, proxy_port, proxy_use_auth);
         }
 
-        if (! strcmp("https", handle->purl->scheme)) {
-            ne_ssl_trust_default_ca(handle->session);
-            ne_ssl_set_verify(handle->session, neon_vfs_verify_environment_ssl_certs, handle->session);
-        }
+        ne_set_session_private(handle->session, "neon-handle", handle);
+        g_free(handle->session_key);
+        handle->session_key = key;
 
         _DEBUG("<%p> Creating request", handle);
         ret = open_request(handle, startbyte);
@@ -589,15 +848,13 @@ static gint open_handle(struct neon_handle* handle, gulong startbyte) {
         }
         else if (ret == -1)
         {
-            ne_session_destroy(handle->session);
-            handle->session = NULL;
+            release_session(handle);
             g_free (proxy_host);
             return -1;
         }
 
         _DEBUG("<%p> Following redirect...", handle);
-        ne_session_destroy(handle->session);
-        handle->session = NULL;
+        release_session(handle);
     }
 
     /*
@@ -618,15 +875,24 @@ static gint open_handle(struct neon_handle* handle, gulong startbyte) {
 static gint fill_buffer(struct neon_handle* h) {
 
     gssize bsize;
-    gchar buffer[NEON_NETBLKSIZE];
-    gssize to_read;
+    gchar* buffer;
+    unsigned int to_read;
+    gint64 start;
+    struct neon_buffering* b = &h->buffering;
 
-    bsize = free_rb(&h->rb);
-    to_read = MIN(bsize, NEON_NETBLKSIZE);
+    /*
+     * Read straight into the ringbuffer. Only this thread writes
+     * to it, so the reserved region stays free until we commit it.
+     */
+    buffer = reserve_rb(&h->rb, &to_read);
+    to_read = MIN(to_read, h->buffering.blksize);
+
+    start = g_get_monotonic_time();
 
     if (0 >= (bsize = ne_read_response_block(h->request, buffer, to_read))) {
         if (0 == bsize) {
             _DEBUG("<%p> End of file encountered", h);
+            h->conn_reusable = (NE_OK == ne_end_request(h->request));
             return 1;
         } else {
             _ERROR ("<%p> Error while reading from the network", (void *) h);
@@ -638,14 +904,131 @@ static gint fill_buffer(struct neon_handle* h) {
 
     _DEBUG("<%p> Read %d bytes of %d", h, (gint) bsize, (gint) to_read);
 
-    if (0 != write_rb(&(h->rb), buffer, bsize)) {
-        _ERROR ("<%p> Error putting data into buffer", (void *) h);
-        return -1;
+    commit_rb(&h->rb, bsize);
+
+    pthread_mutex_lock(&h->reader_status.mutex);
+    h->stats.bytes_received += bsize;
+    pthread_mutex_unlock(&h->reader_status.mutex);
+
+    /*
+     * A single read is often served from the socket buffer and says
+     * nothing about the network, so the rate is taken over enough
+     * data (or time) to include the waits for it.
+     */
+    b->in_bytes += bsize;
+    b->in_time += g_get_monotonic_time() - start;
+
+    if ((b->in_bytes >= NEON_RATE_BYTES) || (b->in_time >= 1000000)) {
+        gdouble rate = b->in_bytes * 1000000.0 / MAX(b->in_time, 1);
+
+        b->in_rate = b->in_rate ? 0.7 * b->in_rate + 0.3 * rate : rate;
+        b->in_bytes = 0;
+        b->in_time = 0;
     }
 
     return 0;
 }
 
+/*
+ * -----
+ */
+
+/*
+ * Choose the buffer sizes from the measured data rates.
+ * The faster the network compared to the player, the less
+ * data we need to keep in store: a LAN stream starts quickly
+ * with a small buffer, a slow or jittery link gets several
+ * seconds worth of data. Each underrun adds some more.
+ * Must be called with reader_status.mutex held.
+ */
+static void adapt_buffering(struct neon_handle* h) {
+
+    struct neon_buffering* b = &h->buffering;
+    gint64 now = g_get_monotonic_time();
+    gdouble rate;
+    gdouble seconds;
+    gdouble headroom;
+
+    if (0 == b->drain_time) {
+        b->drain_time = now;
+        b->drain_mark = b->drained;
+        return;
+    }
+
+    /*
+     * Measure the drain rate once a second, skipping
+     * intervals in which the player took nothing (paused).
+     */
+    if (now - b->drain_time < 1000000) {
+        return;
+    }
+
+    if (b->drained > b->drain_mark) {
+        rate = (b->drained - b->drain_mark) * 1000000.0 / (now - b->drain_time);
+        b->drain_rate = b->drain_rate ? 0.7 * b->drain_rate + 0.3 * rate : rate;
+    }
+
+    b->drain_time = now;
+    b->drain_mark = b->drained;
+
+    if ((0 == b->drain_rate) || (0 == b->in_rate)) {
+        return;
+    }
+
+    headroom = b->in_rate / b->drain_rate;
+
+    if (headroom >= 4) {
+        seconds = 1;
+    } else if (headroom >= 2) {
+        seconds = 2;
+    } else {
+        seconds = 4;
+    }
+
+    seconds = MIN(seconds + 2 * b->underruns, 10);
+
+    b->wanted = CLAMP(b->drain_rate * seconds, NEON_BUFSIZE_MIN, NEON_BUFSIZE_MAX);
+    b->limit = MIN(b->wanted, h->rb.size);
+    b->blksize = CLAMP(b->in_rate / 50, NEON_NETBLKSIZE, NEON_NETBLKSIZE_MAX);
+    b->blksize = MIN(b->blksize, b->limit / 4);
+    b->prebuffer = b->limit / 2;
+
+    _DEBUG("<%p> in %.0f B/s, out %.0f B/s: buffer %u, block %u, prebuffer %u",
+     h, b->in_rate, b->drain_rate, b->limit, b->blksize, b->prebuffer);
+}
+
+/*
+ * The ringbuffer starts small and grows only as far as the stream
+ * needs, so that a handle does not keep a megabyte resident for a
+ * low bitrate stream. Neither side may touch the buffer during the
+ * resize, which therefore happens only while the player is parked
+ * waiting for data, and we hold the mutex.
+ * Must be called with reader_status.mutex held.
+ */
+static void grow_buffer(struct neon_handle* h) {
+
+    struct neon_buffering* b = &h->buffering;
+    unsigned int size = h->rb.size;
+
+    if ((b->wanted <= size) || !b->parked) {
+        return;
+    }
+
+    while (size < b->wanted) {
+        size *= 2;
+    }
+
+    if (0 != resize_rb(&h->rb, size)) {
+        _ERROR("<%p> Could not grow buffer to %u bytes", (void *) h, size);
+        return;
+    }
+
+    b->limit = b->wanted;
+    b->prebuffer = b->limit / 2;
+
+    _DEBUG("<%p> Buffer grown to %u bytes", h, size);
+}
+
 /*
  * -----
  */
@@ -659,10 +1042,13 @@ static gpointer reader_thread(void* data) {
 
     while(h->reader_status.reading) {
 
+        adapt_buffering(h);
+        grow_buffer(h);
+
         /*
-         * Hit the network only if we have more than NEON_NETBLKSIZE of free buffer
+         * Hit the network only if a whole block fits below the fill limit
          */
-        if (NEON_NETBLKSIZE < free_rb_locked(&h->rb)) {
+        if (used_rb(&h->rb) + h->buffering.blksize <= h->buffering.limit) {
             pthread_mutex_unlock(&h->reader_status.mutex);
 
             ret = fill_buffer(h);
@@ -710,6 +1096,98 @@ static gpointer reader_thread(void* data) {
 }
 
 
+/*
+ * -----
+ */
+
+static gint reopen_handle(struct neon_handle* h, glong newpos) {
+
+    /*
+     * To continue reading at a new position we have to
+     * - stop the current reader thread, if there is one
+     * - destroy the current request
+     * - dump all data currently in the ringbuffer
+     * - create a new request starting at newpos
+     */
+    if (h->reader_status.reading)
+        kill_reader(h);
+
+    finish_request(h);
+
+    if (NULL != h->request) {
+        ne_request_destroy(h->request);
+        h->request = NULL;
+    }
+    release_session(h);
+    reset_rb(&h->rb);
+    h->reader_status.status = NEON_READER_INIT;
+    pthread_mutex_lock(&h->reader_status.mutex);
+    h->stats.reconnects++;
+    pthread_mutex_unlock(&h->reader_status.mutex);
+
+    if (0 != open_handle(h, newpos)) {
+        /*
+         * Something went wrong while creating the new request.
+         * There is not much we can do now, we'll set the request
+         * to NULL, so that fread() will error out on the next
+         * read request
+         */
+        _ERROR ("<%p> Error while creating new request!", (void *) h);
+        h->request = NULL;
+        return -1;
+    }
+
+    /*
+     * Things seem to have worked. The next read request will start
+     * the reader thread again.
+     */
+    h->eof = FALSE;
+
+    return 0;
+}
+
+/*
+ * -----
+ */
+
+static gint sync_stream(struct neon_handle* h) {
+
+    gchar buffer[NEON_NETBLKSIZE];
+    glong skip = h->pos - h->stream_pos;
+
+    /*
+     * A short forward seek can be satisfied by skipping over data
+     * that is already in the ringbuffer. Anything else needs a new
+     * request.
+     */
+    if ((0 < skip) && (0 == h->icy_metaint) && (skip <= used_rb(&h->rb))) {
+        _DEBUG("<%p> Skipping %ld buffered bytes", h, skip);
+
+        while (0 < skip) {
+            glong n = MIN(skip, NEON_NETBLKSIZE);
+
+            read_rb(&h->rb, buffer, n);
+
+            if (NULL != h->cache) {
+                neon_cache_write(h->cache, h->stream_pos, buffer, n);
+            }
+
+            h->stream_pos += n;
+            skip -= n;
+        }
+
+        pthread_mutex_lock(&h->reader_status.mutex);
+        pthread_cond_broadcast(&h->reader_status.cond);
+        pthread_mutex_unlock(&h->reader_status.mutex);
+
+        return 0;
+    }
+
+    _DEBUG("<%p> Reopening at %ld", h, h->pos);
+
+    return reopen_handle(h, h->pos);
+}
+
 /*
  * -----
  */
@@ -738,6 +1216,59 @@ void * neon_vfs_fopen_impl (const gchar * path, const gchar * mode)
     return handle;
 }
 
+/*
+ * ----
+ */
+
+static gchar* format_stats(struct neon_handle* h, const gchar* field) {
+
+    struct neon_stats* st = &h->stats;
+    gchar* ret = NULL;
+
+    pthread_mutex_lock(&h->reader_status.mutex);
+
+    if (! strcmp (field, "bytes-received"))
+        ret = g_strdup_printf ("%" G_GINT64_FORMAT, st->bytes_received);
+    else if (! strcmp (field, "requests") || ! strcmp (field, "io-requests"))
+        ret = g_strdup_printf ("%u", st->requests);
+    else if (! strcmp (field, "reconnects"))
+        ret = g_strdup_printf ("%u", st->reconnects);
+    else if (! strcmp (field, "read-retries"))
+        ret = g_strdup_printf ("%u", st->retries);
+    else if (! strcmp (field, "read-wait-time"))
+        ret = g_strdup_printf ("%" G_GINT64_FORMAT, st->wait_time / 1000);
+    else if (! strcmp (field, "read-wait-histogram"))
+        ret = g_strdup_printf ("%u %u %u %u %u %u", st->wait_hist[0], st->wait_hist[1],
+         st->wait_hist[2], st->wait_hist[3], st->wait_hist[4], st->wait_hist[5]);
+    else if (! strcmp (field, "buffer-fill"))
+        ret = g_strdup_printf ("%u", used_rb(&h->rb));
+    else if (! strcmp (field, "buffer-size"))
+        ret = g_strdup_printf ("%u", h->buffering.limit);
+    else if (! strcmp (field, "prebuffer-size"))
+        ret = g_strdup_printf ("%u", h->buffering.prebuffer);
+    else if (! strcmp (field, "block-size"))
+        ret = g_strdup_printf ("%u", h->buffering.blksize);
+    else if (! strcmp (field, "underruns"))
+        ret = g_strdup_printf ("%u", h->buffering.underruns);
+
+    pthread_mutex_unlock(&h->reader_status.mutex);
+
+    return ret;
+}
+
+static void dump_stats(struct neon_handle* h) {
+
+    struct neon_stats* st = &h->stats;
+
+    AUDDBG("%s: %" G_GINT64_FORMAT " bytes received, %u requests, %u reconnects, "
+     "%u underruns, %u read retries, %" G_GINT64_FORMAT " ms waited for data "
+     "(<0.1 ms: %u, <1 ms: %u, <10 ms: %u, <100 ms: %u, <1 s: %u, longer: %u), "
+     "buffer %u bytes\n", h->url, st->bytes_received, st->requests, st->reconnects,
+     h->buffering.underruns, st->retries, st->wait_time / 1000, st->wait_hist[0],
+     st->wait_hist[1], st->wait_hist[2], st->wait_hist[3], st->wait_hist[4],
+     st->wait_hist[5], h->buffering.limit);
+}
+
 /*
  * ----
  */
@@ -749,15 +1280,17 @@ gint neon_vfs_fclose_impl(VFSFile* file) {
     if (h->reader_status.reading)
         kill_reader(h);
 
+    dump_stats(h);
+
+    finish_request(h);
+
     _DEBUG("<%p> Destroying request", h);
     if (NULL != h->request) {
         ne_request_destroy(h->request);
     }
 
-    _DEBUG("<%p> Destroying session", h);
-    if (NULL != h->session) {
-        ne_session_destroy(h->session);
-    }
+    _DEBUG("<%p> Releasing session", h);
+    release_session(h);
 
     handle_free(h);
 
@@ -778,21 +1311,72 @@ static gint64 neon_fread_real (void * ptr_, gint64 size, gint64 nmemb,
     gchar icy_metadata[NEON_ICY_BUFSIZE];
     guchar icy_metalen;
     gint retries;
+    gint64 wait_start;
+    gint64 wait;
+    gint bucket;
 
-    if (NULL == h->request) {
-        _ERROR ("<%p> No request to read from, seek gone wrong?", (void *) h);
+    /*
+     * Check for the end first: after a seek to the end, syncing the
+     * stream would request a range starting beyond it.
+     */
+    if (h->eof || ((-1 != h->content_length) &&
+     (h->pos >= h->content_start + h->content_length))) {
+        h->eof = TRUE;
         return 0;
     }
 
-    if (h->eof)
+    /*
+     * Serve data from the cache if we can. Otherwise make sure the
+     * stream delivers data from our current position.
+     */
+    if (NULL != h->cache) {
+        relem = neon_cache_read(h->cache, h->pos, ptr_, size * nmemb) / size;
+
+        if (0 < relem) {
+            h->pos += (relem*size);
+
+            if (h->pos >= h->content_start + h->content_length) {
+                h->eof = TRUE;
+            }
+
+            return relem;
+        }
+    }
+
+    if ((h->pos != h->stream_pos) && (0 != sync_stream(h))) {
+        return 0;
+    }
+
+    if (NULL == h->request) {
+        _ERROR ("<%p> No request to read from, seek gone wrong?", (void *) h);
         return 0;
+    }
 
     /* If the buffer is empty, wait for the reader thread to fill it. */
+    wait_start = g_get_monotonic_time();
     pthread_mutex_lock(&h->reader_status.mutex);
+    h->buffering.parked = TRUE;
+
+    if ((used_rb(&h->rb) < size) && (0 < h->buffering.drained) &&
+     h->reader_status.reading && (NEON_READER_RUN == h->reader_status.status)) {
+        /*
+         * The buffer ran dry during playback. Refill it up to the
+         * prebuffer threshold instead of handing out data as it
+         * trickles in, which would only lead to the next underrun.
+         */
+        h->buffering.underruns++;
+        _DEBUG("<%p> Buffer underrun, prebuffering %u bytes", h, h->buffering.prebuffer);
+
+        while ((used_rb(&h->rb) < h->buffering.prebuffer) && h->reader_status.reading &&
+         (NEON_READER_RUN == h->reader_status.status)) {
+            pthread_cond_broadcast(&h->reader_status.cond);
+            pthread_cond_wait(&h->reader_status.cond, &h->reader_status.mutex);
+        }
+    }
 
     for (retries = 0; retries < NEON_RETRY_COUNT; retries ++)
     {
-        if (used_rb_locked(&h->rb) / size > 0 || !h->reader_status.reading ||
+        if (used_rb(&h->rb) / size > 0 || !h->reader_status.reading ||
          h->reader_status.status != NEON_READER_RUN)
             break;
 
@@ -800,6 +1384,14 @@ static gint64 neon_fread_real (void * ptr_, gint64 size, gint64 nmemb,
         pthread_cond_wait(&h->reader_status.cond, &h->reader_status.mutex);
     }
 
+    wait = g_get_monotonic_time() - wait_start;
+    for (bucket = 0; bucket < NEON_WAIT_BUCKETS - 1 && wait >= wait_limits[bucket]; bucket++);
+
+    h->stats.retries += retries;
+    h->stats.wait_time += wait;
+    h->stats.wait_hist[bucket]++;
+
+    h->buffering.parked = FALSE;
     pthread_mutex_unlock(&h->reader_status.mutex);
 
     if (!h->reader_status.reading)
@@ -872,7 +1464,7 @@ static gint64 neon_fread_real (void * ptr_, gint64 size, gint64 nmemb,
                  * If there still is data in the buffer, carry on.
                  * If not, terminate the reader thread and return 0.
                  */
-                if (0 == used_rb_locked(&h->rb)) {
+                if (0 == used_rb(&h->rb)) {
                     _DEBUG("<%p> Reached end of stream", h);
                     pthread_mutex_unlock(&h->reader_status.mutex);
 
@@ -954,12 +1546,17 @@ static gint64 neon_fread_real (void * ptr_, gint64 size, gint64 nmemb,
     relem = MIN(belem, nmemb);
     read_rb(&h->rb, ptr_, relem*size);
 
+    if (NULL != h->cache) {
+        neon_cache_write(h->cache, h->stream_pos, ptr_, relem*size);
+    }
+
     /*
      * Signal the network thread to continue reading
      */
     pthread_mutex_lock(&h->reader_status.mutex);
+    h->buffering.drained += (relem*size);
     if (NEON_READER_EOF == h->reader_status.status) {
-        if (0 == free_rb_locked(&h->rb)) {
+        if (0 == free_rb(&h->rb)) {
             _DEBUG("<%p> stream EOF reached and buffer empty", h);
             h->eof = TRUE;
         }
@@ -970,6 +1567,7 @@ static gint64 neon_fread_real (void * ptr_, gint64 size, gint64 nmemb,
     pthread_mutex_unlock(&h->reader_status.mutex);
 
     h->pos += (relem*size);
+    h->stream_pos += (relem*size);
     h->icy_metaleft -= (relem*size);
 
     return relem;
@@ -1126,43 +1724,18 @@ gint neon_vfs_fseek_impl (VFSFile * file, gint64 offset, gint whence)
     }
 
     /*
-     * To seek to the new position we have to
-     * - stop the current reader thread, if there is one
-     * - destroy the current request
-     * - dump all data currently in the ringbuffer
-     * - create a new request starting at newpos
+     * With a cache, the stream is repositioned lazily on the next read
+     * that the cache cannot serve. This way probes of the file tail
+     * and the jump back to the start cost no new request if the data
+     * has been seen before.
      */
-    if (h->reader_status.reading)
-        kill_reader(h);
-
-    if (NULL != h->request) {
-        ne_request_destroy(h->request);
-    }
-    if (NULL != h->session) {
-        ne_session_destroy(h->session);
-        h->session = NULL;
-    }
-    reset_rb(&h->rb);
-
-    if (0 != open_handle(h, newpos)) {
-        /*
-         * Something went wrong while creating the new request.
-         * There is not much we can do now, we'll set the request
-         * to NULL, so that fread() will error out on the next
-         * read request
-         */
-        _ERROR ("<%p> Error while creating new request!", (void *) h);
-        h->request = NULL;
-        return -1;
+    if (NULL != h->cache) {
+        h->pos = newpos;
+        h->eof = FALSE;
+        return 0;
     }
 
-    /*
-     * Things seem to have worked. The next read request will start
-     * the reader thread again.
-     */
-    h->eof = FALSE;
-
-    return 0;
+    return reopen_handle(h, newpos);
 }
 
 void neon_vfs_rewind_impl(VFSFile* file) {
@@ -1188,7 +1761,7 @@ gchar *neon_vfs_metadata_impl(VFSFile* file, const gchar* field) {
     if (! strcmp (field, "content-bitrate"))
         return g_strdup_printf ("%d", h->icy_metadata.stream_bitrate * 1000);
 
-    return NULL;
+    return format_stats (h, field);
 }
 
 /*
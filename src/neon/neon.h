@@ -29,6 +29,7 @@
 #include <ne_session.h>
 #include <ne_request.h>
 #include <ne_uri.h>
+#include "cache.h"
 #include "rb.h"
 
 typedef enum {
@@ -54,12 +55,48 @@ struct icy_metadata {
     gint   stream_bitrate;
 };
 
+/*
+ * All fields are protected by reader_status.mutex,
+ * except for in_rate, which only the thread calling
+ * fill_buffer() accesses.
+ */
+struct neon_buffering {
+    unsigned int limit;                 /* Fill the ringbuffer up to this many bytes */
+    unsigned int blksize;               /* Read from the network in blocks of this size */
+    unsigned int prebuffer;             /* Refill up to this many bytes after an underrun */
+    guint underruns;                    /* Times the player found the buffer empty */
+    unsigned int wanted;                /* Limit chosen from the data rates, may exceed the ringbuffer */
+    gboolean parked;                    /* The player is waiting for data in neon_fread_real */
+    gdouble in_rate;                    /* Bytes per second received from the network */
+    gint64 in_bytes;                    /* Bytes received in the current measurement */
+    gint64 in_time;                     /* Microseconds spent reading in the current measurement */
+    gdouble drain_rate;                 /* Bytes per second taken by the player */
+    gint64 drained;                     /* Bytes taken by the player in total */
+    gint64 drain_mark;                  /* Value of drained at drain_time */
+    gint64 drain_time;                  /* Start of the current measurement, in microseconds */
+};
+
+#define NEON_WAIT_BUCKETS 6
+
+/*
+ * Transport statistics, protected by reader_status.mutex.
+ */
+struct neon_stats {
+    gint64 bytes_received;              /* Bytes read from the network */
+    guint requests;                     /* HTTP requests issued, including redirects */
+    guint reconnects;                   /* Requests issued to continue at another position */
+    guint retries;                      /* Waits for the reader thread, up to NEON_RETRY_COUNT per read */
+    gint64 wait_time;                   /* Microseconds neon_fread_real spent waiting for data */
+    guint wait_hist[NEON_WAIT_BUCKETS]; /* Waits of < 0.1 ms, < 1 ms, < 10 ms, < 100 ms, < 1 s and longer */
+};
+
 struct neon_handle {
     gchar* url;                         /* The URL, as passed to us */
     ne_uri* purl;                       /* The URL, parsed into a structure */
     struct ringbuf rb;                  /* Ringbuffer for our data */
     guchar redircount;                  /* Redirect count for the opened URL */
     long pos;                           /* Current position in the stream (number of last byte delivered to the player) */
+    long stream_pos;                    /* Position in the stream of the next byte in the ringbuffer */
     gulong content_start;               /* Start position in the stream */
     long content_length;                /* Total content length, counting from content_start, if known. -1 if unknown */
     gboolean can_ranges;                /* TRUE if the webserver advertised accept-range: bytes */
@@ -67,10 +104,15 @@ struct neon_handle {
     gulong icy_metaleft;                /* Bytes left until the next metadata block */
     struct icy_metadata icy_metadata;   /* Current ICY metadata */
     ne_session* session;
+    gchar* session_key;                 /* Identifies sessions that can be shared, see session_key() */
     ne_request* request;
+    gboolean conn_reusable;             /* TRUE if the last request was read to its end */
     pthread_t reader;
     struct reader_status reader_status;
     gboolean eof;
+    struct neon_cache* cache;           /* Cached data of this URL, NULL if the stream is not seekable */
+    struct neon_buffering buffering;    /* Buffer sizes chosen from the measured data rates */
+    struct neon_stats stats;
 };
 
 
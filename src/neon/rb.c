@@ -23,6 +23,9 @@
 #include "rb.h"
 #include "debug.h"
 
+#define RB_WPOS(rb) ((guint) g_atomic_int_get(&(rb)->wpos))
+#define RB_RPOS(rb) ((guint) g_atomic_int_get(&(rb)->rpos))
+
 #ifdef RB_DEBUG
 /*
  * An internal assertion function to make sure that the
@@ -33,12 +36,10 @@
  */
 static void _assert_rb(struct ringbuf* rb) {
 
-    unsigned int realused;
-
     _ENTER;
 
-    _DEBUG("rb->buf=%p, rb->end=%p, rb->wp=%p, rb->rp=%p, rb->free=%u, rb->used=%u, rb->size=%u",
-            rb->buf, rb->end, rb->wp, rb->rp, rb->free, rb->used, rb->size);
+    _DEBUG("rb->buf=%p, rb->wpos=%u, rb->rpos=%u, rb->size=%u",
+            rb->buf, RB_WPOS(rb), RB_RPOS(rb), rb->size);
 
     if (0 == rb->size) {
         _ERROR("Buffer size is 0");
@@ -50,34 +51,9 @@ static void _assert_rb(struct ringbuf* rb) {
         abort();
     }
 
-    if (rb->used+rb->free != rb->size) {
-        _ERROR("rb->free and rb->used do not add up to rb->size");
-        abort();
-    }
-
-    if (rb->buf+(rb->size-1) != rb->end) {
-        _ERROR("rb->buf and rb->end not rb->size bytes apart");
-        abort();
-    }
-
-    if ((rb->wp < rb->buf) || (rb->wp > rb->end)) {
-        _ERROR("Write pointer outside buffer space");
-        abort();
-    }
-
-    if ((rb->rp < rb->buf) || (rb->rp > rb->end)) {
-        _ERROR("Read pointer outside buffer space");
-        abort();
-    }
-
-    if (rb->rp <= rb->wp) {
-        realused = rb->wp - rb->rp;
-    } else {
-        realused = (rb->end - rb->rp) + 1 + (rb->wp-rb->buf);
-    }
-
-    if (rb->used != realused) {
-        _ERROR("Usage count is inconsistient (is %d, should be %d)", rb->used, realused);
+    if (RB_WPOS(rb) - RB_RPOS(rb) > rb->size) {
+        _ERROR("Usage count is inconsistient (is %u, size is %u)",
+                RB_WPOS(rb) - RB_RPOS(rb), rb->size);
         abort();
     }
 
@@ -87,28 +63,23 @@ static void _assert_rb(struct ringbuf* rb) {
 
 /*
  * Reset a ringbuffer structure (i.e. discard
- * all data inside of it)
+ * all data inside of it).
+ * Neither the producer nor the consumer may be
+ * accessing the buffer while this is called.
  */
 void reset_rb(struct ringbuf* rb) {
 
     _ENTER;
 
-    _RB_LOCK(rb->lock);
-
-    rb->wp = rb->buf;
-    rb->rp = rb->buf;
-    rb->free = rb->size;
-    rb->used = 0;
-    rb->end = rb->buf+(rb->size-1);
-
-    _RB_UNLOCK(rb->lock);
+    g_atomic_int_set(&rb->wpos, 0);
+    g_atomic_int_set(&rb->rpos, 0);
 
     _LEAVE;
 }
 
 /*
  * Initialize a ringbuffer structure (including
- * memory allocation.
+ * memory allocation). size must be a power of two.
  *
  * Return -1 on error
  */
@@ -116,7 +87,7 @@ int init_rb(struct ringbuf* rb, unsigned int size) {
 
     _ENTER;
 
-    if (0 == size) {
+    if ((0 == size) || (0 != (size & (size - 1)))) {
         _LEAVE -1;
     }
 
@@ -125,22 +96,6 @@ int init_rb(struct ringbuf* rb, unsigned int size) {
     }
     rb->size = size;
 
-#ifdef _RB_USE_GLIB
-    if (NULL == (rb->lock = g_mutex_new())) {
-        _LEAVE -1;
-    }
-#else
-    if (NULL == (rb->lock = malloc(sizeof(pthread_mutex_t)))) {
-        _LEAVE -1;
-    }
-
-    if (0 != pthread_mutex_init(rb->lock, NULL)) {
-        free(rb->lock);
-        _LEAVE -1;
-    }
-#endif
-    rb->_free_lock = 1;
-
     reset_rb(rb);
 
     ASSERT_RB(rb);
@@ -149,156 +104,165 @@ int init_rb(struct ringbuf* rb, unsigned int size) {
 }
 
 /*
- * Initialize a ringbuffer structure (including
- * memory allocation.
- * The mutex to be used is passed in the function call.
- * The mutex must not be held while calling this function.
+ * Change the size of a ringbuffer, keeping the data inside of it.
+ * size must be a power of two and large enough for the data.
+ * Neither the producer nor the consumer may be accessing the
+ * buffer while this is called.
  *
  * Return -1 on error
  */
-int init_rb_with_lock(struct ringbuf* rb, unsigned int size, rb_mutex_t* lock) {
+int resize_rb(struct ringbuf* rb, unsigned int size) {
+
+    guint rpos;
+    guint wpos;
+    guint from;
+    guint to;
+    guint n;
+    char* buf;
 
     _ENTER;
 
-    if (0 == size) {
+    rpos = RB_RPOS(rb);
+    wpos = RB_WPOS(rb);
+
+    if ((0 == size) || (0 != (size & (size - 1))) || (size < wpos - rpos)) {
         _LEAVE -1;
     }
 
-    rb->lock = lock;
-    rb->_free_lock = 0;
-
-    if (NULL == (rb->buf = malloc(size))) {
+    if (NULL == (buf = malloc(size))) {
         _LEAVE -1;
     }
+
+    /* The positions are free-running, so the data only moves within the buffer */
+    while (rpos != wpos) {
+        from = rpos & (rb->size - 1);
+        to = rpos & (size - 1);
+        n = MIN(wpos - rpos, MIN(rb->size - from, size - to));
+
+        memcpy(buf + to, rb->buf + from, n);
+        rpos += n;
+    }
+
+    free(rb->buf);
+    rb->buf = buf;
     rb->size = size;
-    reset_rb(rb);
 
     ASSERT_RB(rb);
 
     _LEAVE 0;
 }
 
+/*
+ * Return the largest contiguous free region of the buffer
+ * and store its length in *size. Data put there becomes
+ * visible to the consumer after commit_rb().
+ */
+void* reserve_rb(struct ringbuf* rb, unsigned int* size) {
+
+    guint wpos;
+    guint free;
+    guint endfree;
+
+    _ENTER;
+
+    wpos = RB_WPOS(rb);
+    free = rb->size - (wpos - RB_RPOS(rb));
+    endfree = rb->size - (wpos & (rb->size - 1));
+
+    *size = MIN(free, endfree);
+
+    _LEAVE rb->buf + (wpos & (rb->size - 1));
+}
+
+/*
+ * Make size bytes written to the region returned by
+ * reserve_rb() available to the consumer.
+ */
+void commit_rb(struct ringbuf* rb, unsigned int size) {
+
+    _ENTER;
+
+    g_atomic_int_set(&rb->wpos, RB_WPOS(rb) + size);
+
+    ASSERT_RB(rb);
+
+    _LEAVE;
+}
+
 /*
  * Write size bytes at buf into the ringbuffer.
  * Return -1 on error (not enough space in buffer)
  */
 int write_rb(struct ringbuf* rb, void* buf, unsigned int size) {
 
-    int ret = -1;
-    int endfree;
+    guint wpos;
+    guint offset;
+    guint endfree;
 
     _ENTER;
 
-    _RB_LOCK(rb->lock);
-
     ASSERT_RB(rb);
 
-    if (rb->free < size) {
-        ret = -1;
-        goto out;
+    if (free_rb(rb) < size) {
+        _LEAVE -1;
     }
 
-    endfree = (rb->end - rb->wp)+1;
+    wpos = RB_WPOS(rb);
+    offset = wpos & (rb->size - 1);
+    endfree = rb->size - offset;
+
     if (endfree < size) {
         /*
          * There is enough space in the buffer, but not in
          * one piece. We need to split the copy into two parts.
          */
-        memcpy(rb->wp, buf, endfree);
+        memcpy(rb->buf + offset, buf, endfree);
         memcpy(rb->buf, (char *) buf + endfree, size - endfree);
-        rb->wp = rb->buf + (size-endfree);
-    } else if (endfree > size) {
-        /*
-         * There is more space than needed at the end
-         */
-        memcpy(rb->wp, buf, size);
-        rb->wp += size;
     } else {
-        /*
-         * There is exactly the space needed at the end.
-         * We need to wrap around the read pointer.
-         */
-        memcpy(rb->wp, buf, size);
-        rb->wp = rb->buf;
+        memcpy(rb->buf + offset, buf, size);
     }
 
-    rb->free -= size;
-    rb->used += size;
+    g_atomic_int_set(&rb->wpos, wpos + size);
 
-    ret = 0;
-
-out:
     ASSERT_RB(rb);
-    _RB_UNLOCK(rb->lock);
 
-    _LEAVE ret;
+    _LEAVE 0;
 }
 
 /*
- * Read size byes from buffer into buf.
+ * Read size bytes from buffer into buf.
  * Return -1 on error (not enough data in buffer)
  */
 int read_rb(struct ringbuf* rb, void* buf, unsigned int size) {
 
-    int ret;
-
-    _ENTER;
-
-    _RB_LOCK(rb->lock);
-    ret = read_rb_locked(rb, buf, size);
-    _RB_UNLOCK(rb->lock);
-
-    _LEAVE ret;
-}
-
-/*
- * Read size bytes from buffer into buf, assuming the buffer lock
- * is already held.
- * Return -1 on error (not enough data in buffer)
- */
-int read_rb_locked(struct ringbuf* rb, void* buf, unsigned int size) {
-
-    int endused;
+    guint rpos;
+    guint offset;
+    guint endused;
 
     _ENTER;
 
     ASSERT_RB(rb);
 
-    if (rb->used < size) {
+    if (used_rb(rb) < size) {
         /* Not enough bytes in buffer */
         _LEAVE -1;
     }
 
-    if (rb->rp < rb->wp) {
-        /*
-        Read pointer is behind write pointer, all the data is available in one chunk
-        */
-        memcpy(buf, rb->rp, size);
-        rb->rp += size;
-    } else {
+    rpos = RB_RPOS(rb);
+    offset = rpos & (rb->size - 1);
+    endused = rb->size - offset;
+
+    if (endused < size) {
         /*
-         * Read pointer is before write pointer
+         * There is enough data in the buffer, but it is fragmented.
          */
-        endused = (rb->end - rb->rp)+1;
-
-        if (size < endused) {
-            /*
-             * Data is available in one chunk
-             */
-            memcpy(buf, rb->rp, size);
-            rb->rp += size;
-        } else {
-            /*
-             * There is enough data in the buffer, but it is fragmented.
-             */
-            memcpy(buf, rb->rp, endused);
-            memcpy((char *) buf + endused, rb->buf, size - endused);
-            rb->rp = rb->buf + (size-endused);
-        }
+        memcpy(buf, rb->buf + offset, endused);
+        memcpy((char *) buf + endused, rb->buf, size - endused);
+    } else {
+        memcpy(buf, rb->buf + offset, size);
     }
 
-    rb->free += size;
-    rb->used -= size;
+    g_atomic_int_set(&rb->rpos, rpos + size);
 
     ASSERT_RB(rb);
 
@@ -310,57 +274,21 @@ int read_rb_locked(struct ringbuf* rb, void* buf, unsigned int size) {
  */
 unsigned int free_rb(struct ringbuf* rb) {
 
-    unsigned int f;
-
     _ENTER;
 
-    _RB_LOCK(rb->lock);
-    f = free_rb_locked(rb);
-    _RB_UNLOCK(rb->lock);
-
-    _LEAVE f;
+    _LEAVE rb->size - (RB_WPOS(rb) - RB_RPOS(rb));
 }
 
-/*
- * Return the amount of free space currently in the rb.
- * Assume the rb lock is already being held.
- */
-unsigned int free_rb_locked(struct ringbuf* rb) {
-
-    _ENTER;
-
-    _LEAVE rb->free;
-}
-
-
 /*
  * Return the amount of used space currently in the rb
  */
 unsigned int used_rb(struct ringbuf* rb) {
 
-    unsigned int u;
-
     _ENTER;
 
-    _RB_LOCK(rb->lock);
-    u = used_rb_locked(rb);
-    _RB_UNLOCK(rb->lock);
-
-    _LEAVE u;
+    _LEAVE RB_WPOS(rb) - RB_RPOS(rb);
 }
 
-/*
- * Return the amount of used space currently in the rb.
- * Assume the rb lock is already being held.
- */
-unsigned int used_rb_locked(struct ringbuf* rb) {
-
-    _ENTER;
-
-    _LEAVE rb->used;
-}
-
-
 /*
  * destroy a ringbuffer
  */
@@ -368,14 +296,5 @@ void destroy_rb(struct ringbuf* rb) {
 
     _ENTER;
     free(rb->buf);
-    if (rb->_free_lock) {
-#ifdef _RB_USE_GLIB
-        g_mutex_free(rb->lock);
-#else
-        pthread_mutex_destroy(rb->lock);
-        free(rb->lock);
-#endif
-    }
-
     _LEAVE;
 }
@@ -17,21 +17,7 @@
 #ifndef _RB_H
 #define _RB_H
 
-#ifdef _RB_USE_GLIB
 #include <glib.h>
-
-typedef GMutex rb_mutex_t;
-#define _RB_LOCK(L) g_mutex_lock(L)
-#define _RB_UNLOCK(L) g_mutex_unlock(L)
-
-#else
-#include <pthread.h>
-
-typedef pthread_mutex_t rb_mutex_t;
-#define _RB_LOCK(L) pthread_mutex_lock(L)
-#define _RB_UNLOCK(L) pthread_mutex_unlock(L)
-#endif
-
 #include <stdlib.h>
 
 #ifdef RB_DEBUG
@@ -40,28 +26,34 @@ typedef pthread_mutex_t rb_mutex_t;
 #define ASSERT_RB(buf)
 #endif
 
+/*
+ * Single-producer/single-consumer ringbuffer.
+ *
+ * One thread may write to the buffer while another one reads from it,
+ * without any locking: the producer only ever advances wpos and the
+ * consumer only ever advances rpos. Both are free-running byte counters,
+ * so the buffer size must be a power of two.
+ */
 struct ringbuf {
-    rb_mutex_t* lock;
-    char _free_lock;
     char* buf;
-    char* end;
-    char* wp;
-    char* rp;
-    unsigned int free;
-    unsigned int used;
     unsigned int size;
+    volatile gint wpos;
+    volatile gint rpos;
 };
 
 int init_rb(struct ringbuf* rb, unsigned int size);
-int init_rb_with_lock(struct ringbuf* rb, unsigned int size, rb_mutex_t* lock);
-int write_rb(struct ringbuf* rb, void* buf, unsigned int size);
-int read_rb(struct ringbuf* rb, void* buf, unsigned int size);
-int read_rb_locked(struct ringbuf* rb, void* buf, unsigned int size);
 void reset_rb(struct ringbuf* rb);
+int resize_rb(struct ringbuf* rb, unsigned int size);
+void destroy_rb(struct ringbuf* rb);
+
+/* Producer side */
+int write_rb(struct ringbuf* rb, void* buf, unsigned int size);
+void* reserve_rb(struct ringbuf* rb, unsigned int* size);
+void commit_rb(struct ringbuf* rb, unsigned int size);
 unsigned int free_rb(struct ringbuf* rb);
-unsigned int free_rb_locked(struct ringbuf* rb);
+
+/* Consumer side */
+int read_rb(struct ringbuf* rb, void* buf, unsigned int size);
 unsigned int used_rb(struct ringbuf* rb);
-unsigned int used_rb_locked(struct ringbuf* rb);
-void destroy_rb(struct ringbuf* rb);
 
 #endif
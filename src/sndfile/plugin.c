@@ -40,10 +40,12 @@
 
 #include <math.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <sndfile.h>
 
+#include <audacious/debug.h>
 #include <audacious/plugin.h>
 #include <audacious/i18n.h>
 
@@ -290,6 +292,64 @@ static Tuple * get_song_tuple (const char * filename, VFSFile * file)
     return ti;
 }
 
+/* Uncompressed PCM in the common containers is read with sf_read_raw() and
+ * handed to the output as stored in the file, which skips libsndfile's
+ * per-sample conversion to float.  Packed 24-bit samples only need widening
+ * to 32 bits.  Returns the output format and sample width, or -1 if the file
+ * has to be decoded to float. */
+static int raw_format (const SF_INFO * sfinfo, bool_t swap, int * width)
+{
+    switch (sfinfo->format & SF_FORMAT_TYPEMASK)
+    {
+    case SF_FORMAT_WAV:
+    case SF_FORMAT_WAVEX:
+    case SF_FORMAT_W64:
+    case SF_FORMAT_AIFF:
+    case SF_FORMAT_CAF:
+    case SF_FORMAT_AU:
+        break;
+    default:
+        return -1;
+    }
+
+    /* byte order of the file */
+    bool_t big = ((FMT_S16_NE == FMT_S16_BE) != swap);
+
+    switch (sfinfo->format & SF_FORMAT_SUBMASK)
+    {
+    case SF_FORMAT_PCM_U8:
+        * width = 1;
+        return FMT_U8;
+    case SF_FORMAT_PCM_S8:
+        * width = 1;
+        return FMT_S8;
+    case SF_FORMAT_PCM_16:
+        * width = 2;
+        return big ? FMT_S16_BE : FMT_S16_LE;
+    case SF_FORMAT_PCM_24:
+        * width = 3;
+        return FMT_S24_NE;
+    case SF_FORMAT_PCM_32:
+        * width = 4;
+        return big ? FMT_S32_BE : FMT_S32_LE;
+    case SF_FORMAT_FLOAT:
+        * width = 4;
+        return swap ? -1 : FMT_FLOAT;
+    default:
+        return -1;
+    }
+}
+
+static void widen_24 (const unsigned char * in, int32_t * out, int count,
+ bool_t big)
+{
+    int hi = big ? 0 : 2, lo = big ? 2 : 0;
+
+    for (int i = 0; i < count; i ++, in += 3)
+        out[i] = (int32_t) ((uint32_t) in[hi] << 24 | (uint32_t) in[1] << 16 |
+         (uint32_t) in[lo] << 8) >> 8;
+}
+
 static bool_t play_start (InputPlayback * playback, const char * filename,
  VFSFile * file, int start_time, int stop_time, bool_t pause)
 {
@@ -302,8 +362,15 @@ static bool_t play_start (InputPlayback * playback, const char * filename,
     if (sndfile == NULL)
         return FALSE;
 
-    if (! playback->output->open_audio (FMT_FLOAT, sfinfo.samplerate,
-     sfinfo.channels))
+    bool_t swap = sf_command (sndfile, SFC_RAW_DATA_NEEDS_ENDSWAP, NULL, 0);
+    int width = 0;
+    int format = raw_format (& sfinfo, swap, & width);
+    bool_t raw = (format >= 0);
+
+    AUDDBG ("%s: %s\n", filename, raw ? "reading raw PCM" : "decoding to float");
+
+    if (! playback->output->open_audio (raw ? format : FMT_FLOAT,
+     sfinfo.samplerate, sfinfo.channels))
     {
         sf_close (sndfile);
         return FALSE;
@@ -318,8 +385,10 @@ static bool_t play_start (InputPlayback * playback, const char * filename,
     stop_flag = FALSE;
     playback->set_pb_ready(playback);
 
-    int size = sfinfo.channels * (sfinfo.samplerate / 50);
-    float * buffer = malloc (sizeof (float) * size);
+    /* raw reads are cheap, so they are done in larger blocks */
+    int size = sfinfo.channels * (sfinfo.samplerate / (raw ? 10 : 50));
+    void * buffer = malloc (raw ? width * size : sizeof (float) * size);
+    int32_t * wide = (width == 3) ? malloc (sizeof (int32_t) * size) : NULL;
 
     while (stop_time < 0 || playback->output->written_time () < stop_time)
     {
@@ -341,16 +410,36 @@ static bool_t play_start (InputPlayback * playback, const char * filename,
 
         pthread_mutex_unlock (& mutex);
 
-        int samples = sf_read_float (sndfile, buffer, size);
+        if (raw)
+        {
+            int samples = sf_read_raw (sndfile, buffer, width * size) / width;
+
+            if (samples <= 0)
+                break;
+
+            if (wide)
+            {
+                widen_24 (buffer, wide, samples, (FMT_S16_NE == FMT_S16_BE) !=
+                 swap);
+                playback->output->write_audio (wide, sizeof (int32_t) * samples);
+            }
+            else
+                playback->output->write_audio (buffer, width * samples);
+        }
+        else
+        {
+            int samples = sf_read_float (sndfile, buffer, size);
 
-        if (! samples)
-            break;
+            if (! samples)
+                break;
 
-        playback->output->write_audio (buffer, sizeof (float) * samples);
+            playback->output->write_audio (buffer, sizeof (float) * samples);
+        }
     }
 
     sf_close (sndfile);
     free (buffer);
+    free (wide);
 
     pthread_mutex_lock (& mutex);
     stop_flag = TRUE;
@@ -18,7 +18,7 @@
  */
 
 #include <errno.h>
-#include <stddef.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,19 +28,64 @@
 #include <unistd.h>
 
 #include <audacious/i18n.h>
+#include <audacious/misc.h>
 #include <audacious/plugin.h>
 #include <libaudcore/audstrings.h>
 
 #include "config.h"
 
-#define INT_TO_POINTER(x) ((void *) (ptrdiff_t) (x))
-#define POINTER_TO_INT(x) ((int) (ptrdiff_t) (x))
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #define unix_error(...) do { \
     fprintf (stderr, __VA_ARGS__); \
     fputc ('\n', stderr); \
 } while (0)
 
+#define PREFETCH_TRIGGER (64 << 10)
+#define PREFETCH_SIZE (2 << 20)
+
+/* Reads are served from a per-handle read-ahead buffer so that small reads,
+ * getc/ungetc and short seeks do not each cost a system call.  The buffer
+ * holds the bytes just before the kernel's file offset:
+ *
+ *     [offset - buf_len, offset)  <- buffered range
+ *     offset - buf_len + buf_pos  <- position seen by the caller
+ *
+ * Writes, truncation and seeks outside the buffered range discard it.
+ *
+ * If the "mmap" option is set, regular files opened read-only are instead
+ * mapped into memory as a whole, so that reads and seeks do not need any
+ * system call at all.  It is off by default: if the file is truncated while
+ * mapped (e.g. by a tag editor), reading past the new end raises SIGBUS
+ * instead of returning a short read. */
+
+typedef struct {
+    int fd;
+    int64_t offset;     /* kernel file offset, -1 if unknown */
+    char * buf;         /* NULL if read-ahead is disabled */
+    int buf_size;
+    int buf_len;
+    int buf_pos;
+    int64_t syscalls;
+    int64_t read_total; /* bytes read, until the prefetch has been issued */
+    const char * map;   /* NULL if the file is not mapped */
+    int64_t map_size;
+    int64_t map_pos;
+} UnixFile;
+
+static const char * const unix_defaults[] = {
+ "readahead", "32",  /* KiB */
+ "mmap", "FALSE",
+ NULL};
+
+static bool_t unix_init (void)
+{
+    aud_config_set_defaults ("unix-io", unix_defaults);
+    return TRUE;
+}
+
 static void * unix_fopen (const char * uri, const char * mode)
 {
     bool_t update;
@@ -92,32 +137,167 @@ static void * unix_fopen (const char * uri, const char * mode)
     }
 
     free (filename);
-    return INT_TO_POINTER (handle);
+
+    UnixFile * file = calloc (1, sizeof (UnixFile));
+    file->fd = handle;
+    file->offset = (mode_flag & O_APPEND) ? -1 : 0;
+    file->syscalls = 1;
+
+#ifdef HAVE_POSIX_FADVISE
+    /* Decoders read front to back, so ask the kernel for aggressive
+     * read-ahead.  Prefetching is left to unix_fread(), since most read-only
+     * opens are probes that only look at a few headers. */
+    if (! strcmp (mode, "r"))
+    {
+        posix_fadvise (handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+        file->syscalls ++;
+    }
+#endif
+
+    if (strcmp (mode, "r"))
+        file->read_total = -1;  /* no prefetching */
+
+#ifdef HAVE_MMAP
+    if (! strcmp (mode, "r") && aud_get_bool ("unix-io", "mmap"))
+    {
+        struct stat info;
+
+        file->syscalls ++;
+
+        if (! fstat (handle, & info) && S_ISREG (info.st_mode) &&
+         info.st_size > 0 && (uint64_t) info.st_size <= SIZE_MAX)
+        {
+            void * map = mmap (NULL, info.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+
+            file->syscalls ++;
+
+            if (map != MAP_FAILED)
+            {
+                posix_madvise (map, info.st_size, POSIX_MADV_SEQUENTIAL);
+                file->syscalls ++;
+
+                file->map = map;
+                file->map_size = info.st_size;
+                return file;
+            }
+        }
+    }
+#endif
+
+    /* In append mode every write moves the offset to the end of the file, so
+     * the buffered range could not be tracked; it is only used for reading
+     * anyway. */
+    if ((mode[0] == 'r' || update) && ! (mode_flag & O_APPEND))
+    {
+        int size = aud_get_int ("unix-io", "readahead");
+
+        if (size > 0)
+        {
+            file->buf_size = MIN (size, 1024) * 1024;
+            file->buf = malloc (file->buf_size);
+        }
+    }
+
+    return file;
 }
 
-static int unix_fclose (VFSFile * file)
+static int unix_fclose (VFSFile * vfs)
 {
-    int handle = POINTER_TO_INT (vfs_get_handle (file));
+    UnixFile * file = vfs_get_handle (vfs);
     int result = 0;
 
-    if (close (handle) < 0)
+#ifdef HAVE_MMAP
+    if (file->map)
+        munmap ((void *) file->map, file->map_size);
+#endif
+
+    if (close (file->fd) < 0)
     {
         unix_error ("close failed: %s.", strerror (errno));
         result = -1;
     }
 
+    free (file->buf);
+    free (file);
     return result;
 }
 
-static int64_t unix_fread (void * ptr, int64_t size, int64_t nitems, VFSFile * file)
+/* Discards the read-ahead buffer, moving the kernel file offset back to the
+ * position seen by the caller. */
+static int unix_drop_buffer (UnixFile * file)
+{
+    if (file->buf_pos < file->buf_len)
+    {
+        int64_t pos = file->offset - file->buf_len + file->buf_pos;
+
+        file->syscalls ++;
+        file->offset = lseek (file->fd, pos, SEEK_SET);
+
+        if (file->offset < 0)
+        {
+            unix_error ("lseek failed: %s.", strerror (errno));
+            file->buf_len = file->buf_pos = 0;
+            return -1;
+        }
+    }
+
+    file->buf_len = file->buf_pos = 0;
+    return 0;
+}
+
+/* Once a handle has read more than a probe would, it is most likely being
+ * played; fetch the next PREFETCH_SIZE bytes in the background so that the
+ * decoder does not wait for the disk (or network file system). */
+static void unix_prefetch (UnixFile * file, int64_t readed)
+{
+#ifdef HAVE_POSIX_FADVISE
+    if (file->read_total < 0 || (file->read_total += readed) < PREFETCH_TRIGGER
+     || file->offset < 0)
+        return;
+
+    posix_fadvise (file->fd, file->offset, PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+    file->syscalls ++;
+#endif
+
+    file->read_total = -1;
+}
+
+static int64_t unix_fread (void * ptr, int64_t size, int64_t nitems, VFSFile * vfs)
 {
-    int handle = POINTER_TO_INT (vfs_get_handle (file));
+    UnixFile * file = vfs_get_handle (vfs);
     int64_t goal = size * nitems;
     int64_t total = 0;
 
+    if (file->map)
+    {
+        total = MIN (goal, MAX (file->map_size - file->map_pos, 0));
+        memcpy (ptr, file->map + file->map_pos, total);
+        file->map_pos += total;
+        return (size > 0) ? total / size : 0;
+    }
+
     while (total < goal)
     {
-        int64_t readed = read (handle, (char *) ptr + total, goal - total);
+        if (file->buf_pos < file->buf_len)
+        {
+            int64_t copy = MIN (goal - total, file->buf_len - file->buf_pos);
+
+            memcpy ((char *) ptr + total, file->buf + file->buf_pos, copy);
+            file->buf_pos += copy;
+            total += copy;
+            continue;
+        }
+
+        int64_t readed;
+
+        file->buf_len = file->buf_pos = 0;
+        file->syscalls ++;
+
+        /* large reads bypass the buffer */
+        if (! file->buf || goal - total >= file->buf_size)
+            readed = read (file->fd, (char *) ptr + total, goal - total);
+        else
+            readed = read (file->fd, file->buf, file->buf_size);
 
         if (readed < 0)
         {
@@ -128,22 +308,40 @@ static int64_t unix_fread (void * ptr, int64_t size, int64_t nitems, VFSFile * f
         if (! readed)
             break;
 
-        total += readed;
+        if (file->offset >= 0)
+            file->offset += readed;
+
+        unix_prefetch (file, readed);
+
+        if (! file->buf || goal - total >= file->buf_size)
+            total += readed;
+        else
+            file->buf_len = readed;
     }
 
     return (size > 0) ? total / size : 0;
 }
 
 static int64_t unix_fwrite (const void * ptr, int64_t size, int64_t nitems,
- VFSFile * file)
+ VFSFile * vfs)
 {
-    int handle = POINTER_TO_INT (vfs_get_handle (file));
+    UnixFile * file = vfs_get_handle (vfs);
     int64_t goal = size * nitems;
     int64_t total = 0;
 
+    if (file->map)
+    {
+        unix_error ("write failed: file is open for reading only.");
+        return 0;
+    }
+
+    if (unix_drop_buffer (file) < 0)
+        return 0;
+
     while (total < goal)
     {
-        int64_t written = write (handle, (char *) ptr + total, goal - total);
+        file->syscalls ++;
+        int64_t written = write (file->fd, (char *) ptr + total, goal - total);
 
         if (written < 0)
         {
@@ -151,29 +349,82 @@ static int64_t unix_fwrite (const void * ptr, int64_t size, int64_t nitems,
             break;
         }
 
+        if (file->offset >= 0)
+            file->offset += written;
+
         total += written;
     }
 
     return (size > 0) ? total / size : 0;
 }
 
-static int unix_fseek (VFSFile * file, int64_t offset, int whence)
+static int unix_fseek (VFSFile * vfs, int64_t offset, int whence)
 {
-    int handle = POINTER_TO_INT (vfs_get_handle (file));
+    UnixFile * file = vfs_get_handle (vfs);
+
+    if (file->map)
+    {
+        if (whence == SEEK_CUR)
+            offset += file->map_pos;
+        else if (whence == SEEK_END)
+            offset += file->map_size;
+
+        if (offset < 0)
+        {
+            unix_error ("lseek failed: %s.", strerror (EINVAL));
+            return -1;
+        }
 
-    if (lseek (handle, offset, whence) < 0)
+        file->map_pos = offset;
+        return 0;
+    }
+
+    if (file->buf_len && whence != SEEK_END)
+    {
+        int64_t start = file->offset - file->buf_len;
+
+        if (whence == SEEK_CUR)
+        {
+            offset += start + file->buf_pos;
+            whence = SEEK_SET;
+        }
+
+        /* short seeks within the buffered range need no system call */
+        if (offset >= start && offset <= file->offset)
+        {
+            file->buf_pos = offset - start;
+            return 0;
+        }
+    }
+
+    file->buf_len = file->buf_pos = 0;
+    file->syscalls ++;
+
+    int64_t result = lseek (file->fd, offset, whence);
+
+    if (result < 0)
     {
         unix_error ("lseek failed: %s.", strerror (errno));
+        file->offset = -1;
         return -1;
     }
 
+    file->offset = result;
     return 0;
 }
 
-static int64_t unix_ftell (VFSFile * file)
+static int64_t unix_ftell (VFSFile * vfs)
 {
-    int handle = POINTER_TO_INT (vfs_get_handle (file));
-    int64_t result = lseek (handle, 0, SEEK_CUR);
+    UnixFile * file = vfs_get_handle (vfs);
+
+    if (file->map)
+        return file->map_pos;
+
+    if (file->offset >= 0)
+        return file->offset - file->buf_len + file->buf_pos;
+
+    file->syscalls ++;
+    int64_t result = lseek (file->fd, 0, SEEK_CUR);
 
     if (result < 0)
         unix_error ("lseek failed: %s.", strerror (errno));
@@ -181,16 +432,41 @@ static int64_t unix_ftell (VFSFile * file)
     return result;
 }
 
-static int unix_getc (VFSFile * file)
+static int unix_getc (VFSFile * vfs)
 {
+    UnixFile * file = vfs_get_handle (vfs);
     unsigned char c;
 
-    return (unix_fread (& c, 1, 1, file) == 1) ? c : -1;
+    if (file->map)
+        return (file->map_pos < file->map_size) ?
+         (unsigned char) file->map[file->map_pos ++] : -1;
+
+    if (file->buf_pos < file->buf_len)
+        return (unsigned char) file->buf[file->buf_pos ++];
+
+    return (unix_fread (& c, 1, 1, vfs) == 1) ? c : -1;
 }
 
-static int unix_ungetc (int c, VFSFile * file)
+static int unix_ungetc (int c, VFSFile * vfs)
 {
-    return (! unix_fseek (file, -1, SEEK_CUR)) ? c : -1;
+    UnixFile * file = vfs_get_handle (vfs);
+
+    if (file->map)
+    {
+        if (file->map_pos < 1)
+            return -1;
+
+        file->map_pos --;
+        return c;
+    }
+
+    if (file->buf_pos > 0)
+    {
+        file->buf_pos --;
+        return c;
+    }
+
+    return (! unix_fseek (vfs, -1, SEEK_CUR)) ? c : -1;
 }
 
 static void unix_rewind (VFSFile * file)
@@ -209,11 +485,21 @@ static bool_t unix_feof (VFSFile * file)
     return FALSE;
 }
 
-static int unix_ftruncate (VFSFile * file, int64_t length)
+static int unix_ftruncate (VFSFile * vfs, int64_t length)
 {
-    int handle = POINTER_TO_INT (vfs_get_handle (file));
+    UnixFile * file = vfs_get_handle (vfs);
+
+    if (file->map)
+    {
+        unix_error ("ftruncate failed: file is open for reading only.");
+        return -1;
+    }
 
-    int result = ftruncate (handle, length);
+    if (unix_drop_buffer (file) < 0)
+        return -1;
+
+    file->syscalls ++;
+    int result = ftruncate (file->fd, length);
 
     if (result < 0)
         unix_error ("ftruncate failed: %s.", strerror (errno));
@@ -221,24 +507,40 @@ static int unix_ftruncate (VFSFile * file, int64_t length)
     return result;
 }
 
-static int64_t unix_fsize (VFSFile * file)
+static int64_t unix_fsize (VFSFile * vfs)
 {
-    int64_t position, length;
+    UnixFile * file = vfs_get_handle (vfs);
+    struct stat info;
 
-    position = unix_ftell (file);
+    file->syscalls ++;
 
-    if (position < 0)
+    if (fstat (file->fd, & info) < 0)
+    {
+        unix_error ("fstat failed: %s.", strerror (errno));
         return -1;
+    }
 
-    unix_fseek (file, 0, SEEK_END);
-    length = unix_ftell (file);
-
-    if (length < 0)
+    /* pipes and devices have no meaningful size */
+    if (! S_ISREG (info.st_mode))
         return -1;
 
-    unix_fseek (file, position, SEEK_SET);
+    return info.st_size;
+}
+
+/* "io-requests" is answered by the gio and neon transports as well, so that
+ * access patterns can be compared across transports (see bench/vfs-bench.c). */
+static char * unix_get_metadata (VFSFile * vfs, const char * field)
+{
+    UnixFile * file = vfs_get_handle (vfs);
+    char buf[32];
+
+    if (! strcmp (field, "syscall-count") || ! strcmp (field, "io-requests"))
+    {
+        snprintf (buf, sizeof buf, "%" PRId64, file->syscalls);
+        return strdup (buf);
+    }
 
-    return length;
+    return NULL;
 }
 
 static const char unix_about[] =
@@ -260,7 +562,8 @@ static VFSConstructor constructor = {
     .vfs_ftell_impl = unix_ftell,
     .vfs_feof_impl = unix_feof,
     .vfs_ftruncate_impl = unix_ftruncate,
-    .vfs_fsize_impl = unix_fsize
+    .vfs_fsize_impl = unix_fsize,
+    .vfs_get_metadata_impl = unix_get_metadata
 };
 
 AUD_TRANSPORT_PLUGIN
@@ -269,5 +572,6 @@ AUD_TRANSPORT_PLUGIN
     .domain = PACKAGE,
     .about_text = unix_about,
     .schemes = unix_schemes,
+    .init = unix_init,
     .vtable = & constructor
 )
@@ -0,0 +1,170 @@
+/*
+ * Persistent page index for the Vorbis decoder plugin
+ * Copyright (C) 2012 Audacious development team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/*
+ * Page index for seeking.  ov_time_seek() bisects the file, which on long
+ * recordings or chained files means many scattered reads.  While a file plays,
+ * the byte offset of an Ogg page is recorded every SEEK_STEP_SECONDS together
+ * with the (absolute) sample position in front of it.  The index is kept under
+ * the user directory (see index-file.h).
+ */
+
+#include <glib.h>
+
+#include "../index-file/index-file.h"
+#include "vorbis.h"
+
+#define SEEK_STEP_SECONDS 2
+#define INDEX_DIR "vorbis-index"
+#define INDEX_MAGIC "AUDOVIX2"
+#define INDEX_MAX_POINTS (1 << 20)
+
+typedef struct {
+    gint64 step;
+    gint32 count;
+    gint32 reserved;
+} IndexData;
+
+static const guchar page_sync[4] = {'O', 'g', 'g', 'S'};
+static const guchar page_sync_mask[4] = {0xff, 0xff, 0xff, 0xff};
+
+/* Returns the number of points before the given sample. */
+static gint find_point (const SeekIndex * index, gint64 pcm)
+{
+    gint low = 0, high = index->points->len;
+
+    while (low < high)
+    {
+        gint mid = (low + high) / 2;
+
+        if (g_array_index (index->points, SeekPoint, mid).pcm < pcm)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+void seek_index_load (SeekIndex * index, const gchar * filename, VFSFile * file,
+ gint rate)
+{
+    IndexFile f;
+    IndexData data;
+
+    index->points = g_array_new (FALSE, FALSE, sizeof (SeekPoint));
+    index->step = (gint64) rate * SEEK_STEP_SECONDS;
+    index->changed = FALSE;
+
+    if (! index_file_open (& f, INDEX_DIR, INDEX_MAGIC, filename, file))
+        return;
+
+    if (fread (& data, sizeof data, 1, f.handle) != 1 || data.step !=
+     index->step || data.count <= 0 || data.count > INDEX_MAX_POINTS)
+        goto FAIL;
+
+    g_array_set_size (index->points, data.count);
+
+    if (fread (index->points->data, sizeof (SeekPoint), data.count, f.handle) !=
+     data.count)
+        goto FAIL;
+
+    if (! f.local && ! (index_file_has_sync (file, g_array_index (index->points,
+     SeekPoint, data.count / 2).offset, page_sync, page_sync_mask, 4) &&
+     index_file_has_sync (file, g_array_index (index->points, SeekPoint,
+     data.count - 1).offset, page_sync, page_sync_mask, 4)))
+    {
+        AUDDBG ("Seek points for %s do not match the file.\n", filename);
+        goto FAIL;
+    }
+
+    index_file_close (& f, TRUE);
+
+    AUDDBG ("Loaded %d seek points for %s.\n", data.count, filename);
+    return;
+
+FAIL:
+    g_array_set_size (index->points, 0);
+    index_file_close (& f, FALSE);
+}
+
+void seek_index_save (SeekIndex * index, const gchar * filename, VFSFile * file)
+{
+    IndexFile f;
+    IndexData data = {index->step, index->points->len, 0};
+
+    if (! index->changed || ! index->points->len)
+        return;
+
+    if (! index_file_create (& f, INDEX_DIR, INDEX_MAGIC, filename, file))
+        return;
+
+    gboolean ok = (fwrite (& data, sizeof data, 1, f.handle) == 1 && fwrite
+     (index->points->data, sizeof (SeekPoint), data.count, f.handle) ==
+     data.count);
+
+    if (index_file_commit (& f, ok))
+    {
+        AUDDBG ("Saved %d seek points for %s.\n", data.count, filename);
+        index->changed = FALSE;
+    }
+}
+
+void seek_index_free (SeekIndex * index)
+{
+    g_array_free (index->points, TRUE);
+    index->points = NULL;
+}
+
+/* Playback may skip around, so the points are kept sorted and a new one is
+ * only taken where there is a gap of at least one step. */
+void seek_index_add (SeekIndex * index, gint64 pcm, gint64 offset)
+{
+    if (index->step <= 0 || pcm < 0 || offset < 0 || index->points->len >=
+     INDEX_MAX_POINTS)
+        return;
+
+    gint i = find_point (index, pcm);
+
+    if (i < index->points->len && g_array_index (index->points, SeekPoint,
+     i).pcm - pcm < index->step)
+        return;
+    if (i > 0 && pcm - g_array_index (index->points, SeekPoint, i - 1).pcm <
+     index->step)
+        return;
+
+    SeekPoint point = {pcm, offset};
+    g_array_insert_val (index->points, i, point);
+    index->changed = TRUE;
+}
+
+/* Returns the position of the last point at or before the given sample, or -1
+ * if there is none close enough to be worth decoding forward from. */
+gint seek_index_find (const SeekIndex * index, gint64 pcm)
+{
+    gint i = find_point (index, pcm + 1) - 1;
+
+    if (i < 0 || pcm - g_array_index (index->points, SeekPoint, i).pcm > 2 *
+     index->step)
+        return -1;
+
+    return i;
+}
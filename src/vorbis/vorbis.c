@@ -35,10 +35,15 @@
 #include <string.h>
 #include <math.h>
 
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
 #include <ogg/ogg.h>
 #include <vorbis/codec.h>
 #include <vorbis/vorbisfile.h>
 
+#include <audacious/debug.h>
 #include <audacious/i18n.h>
 #include <audacious/misc.h>
 #include <audacious/plugin.h>
@@ -271,20 +276,157 @@ vorbis_update_replaygain(OggVorbis_File *vf, ReplayGainInfo *rg_info)
     return TRUE;
 }
 
+/* Vorbis channel order (Vorbis I specification, section 4.3.9) to the WAVE
+ * order used by the output plugins, indexed by channel count */
+static const gint vorbis_channel_map[8][8] = {
+ {0},
+ {0, 1},
+ {0, 2, 1},
+ {0, 1, 2, 3},
+ {0, 2, 1, 3, 4},
+ {0, 2, 1, 5, 3, 4},
+ {0, 2, 1, 6, 5, 3, 4},
+ {0, 2, 1, 7, 5, 6, 3, 4}};
+
+/* Stereo and 5.1/7.1 are interleaved four frames at a time with SSE
+ * (unpack or 4x4 transpose); the reordering is done by picking the planes,
+ * so it costs nothing.  Leftover frames and other layouts use the plain
+ * loop. */
 static long
 vorbis_interleave_buffer(float **pcm, int samples, int ch, float *pcmout)
 {
-    int i, j;
-    for (i = 0; i < samples; i++)
+    const float * in[8];
+    int i = 0, j;
+
+    for (j = 0; j < ch; j++)
+        in[j] = pcm[vorbis_channel_map[ch - 1][j]];
+
+    if (ch == 1)
+    {
+        memcpy (pcmout, in[0], samples * sizeof (float));
+        return samples * sizeof (float);
+    }
+
+#ifdef __SSE__
+    if (ch == 2)
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            __m128 l = _mm_loadu_ps (in[0] + i);
+            __m128 r = _mm_loadu_ps (in[1] + i);
+            _mm_storeu_ps (pcmout + 2 * i, _mm_unpacklo_ps (l, r));
+            _mm_storeu_ps (pcmout + 2 * i + 4, _mm_unpackhi_ps (l, r));
+        }
+    }
+    else if (ch == 6)
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            __m128 a = _mm_loadu_ps (in[0] + i), b = _mm_loadu_ps (in[1] + i);
+            __m128 c = _mm_loadu_ps (in[2] + i), d = _mm_loadu_ps (in[3] + i);
+            __m128 e = _mm_loadu_ps (in[4] + i), f = _mm_loadu_ps (in[5] + i);
+            __m128 lo = _mm_unpacklo_ps (e, f), hi = _mm_unpackhi_ps (e, f);
+            float * out = pcmout + 6 * i;
+
+            _MM_TRANSPOSE4_PS (a, b, c, d);
+            _mm_storeu_ps (out, a);
+            _mm_storel_pi ((__m64 *) (out + 4), lo);
+            _mm_storeu_ps (out + 6, b);
+            _mm_storeh_pi ((__m64 *) (out + 10), lo);
+            _mm_storeu_ps (out + 12, c);
+            _mm_storel_pi ((__m64 *) (out + 16), hi);
+            _mm_storeu_ps (out + 18, d);
+            _mm_storeh_pi ((__m64 *) (out + 22), hi);
+        }
+    }
+    else if (ch == 8)
+    {
+        for (; i + 4 <= samples; i += 4)
+        {
+            __m128 a = _mm_loadu_ps (in[0] + i), b = _mm_loadu_ps (in[1] + i);
+            __m128 c = _mm_loadu_ps (in[2] + i), d = _mm_loadu_ps (in[3] + i);
+            __m128 e = _mm_loadu_ps (in[4] + i), f = _mm_loadu_ps (in[5] + i);
+            __m128 g = _mm_loadu_ps (in[6] + i), h = _mm_loadu_ps (in[7] + i);
+            float * out = pcmout + 8 * i;
+
+            _MM_TRANSPOSE4_PS (a, b, c, d);
+            _MM_TRANSPOSE4_PS (e, f, g, h);
+            _mm_storeu_ps (out, a);
+            _mm_storeu_ps (out + 4, e);
+            _mm_storeu_ps (out + 8, b);
+            _mm_storeu_ps (out + 12, f);
+            _mm_storeu_ps (out + 16, c);
+            _mm_storeu_ps (out + 20, g);
+            _mm_storeu_ps (out + 24, d);
+            _mm_storeu_ps (out + 28, h);
+        }
+    }
+#endif
+
+    for (pcmout += ch * i; i < samples; i++)
         for (j = 0; j < ch; j++)
-            *pcmout++ = pcm[j][i];
+            *pcmout++ = in[j][i];
 
     return ch * samples * sizeof(float);
 }
 
 
 #define PCM_FRAMES 1024
-#define PCM_BUFSIZE (PCM_FRAMES * 2)
+
+/* Index positions are counted in samples, which only maps to time if all
+ * links of a chained file share one sample rate. */
+static gboolean single_rate (OggVorbis_File * vf, gint rate)
+{
+    for (glong i = 0; i < ov_streams (vf); i ++)
+    {
+        if (ov_info (vf, i)->rate != rate)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Jumps to the page recorded before the target and decodes forward to the
+ * exact sample, so a seek costs one read.  The page can start a little past
+ * its recorded position, so the point before is tried if it overshoots.
+ * Returns FALSE if ov_time_seek() has to do the job. */
+static gboolean seek_with_index (OggVorbis_File * vf, const SeekIndex * index,
+ gint64 target)
+{
+    gint i = seek_index_find (index, target);
+
+    for (gint tries = 0; i >= 0 && tries < 2; i --, tries ++)
+    {
+        const SeekPoint * point = & g_array_index (index->points, SeekPoint, i);
+
+        if (ov_raw_seek (vf, point->offset) < 0)
+            return FALSE;
+
+        gint64 pos = ov_pcm_tell (vf);
+
+        if (pos < 0 || pos > target)
+            continue;
+
+        while (pos < target)
+        {
+            gfloat * * pcm;
+            gint section;
+            glong samples = ov_read_float (vf, & pcm, MIN (target - pos,
+             PCM_FRAMES), & section);
+
+            if (samples == OV_HOLE)
+                continue;
+            if (samples <= 0)
+                return FALSE;
+
+            pos += samples;
+        }
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
 
 static gboolean vorbis_play (InputPlayback * playback, const gchar * filename,
  VFSFile * file, gint start_time, gint stop_time, gboolean pause)
@@ -296,9 +438,11 @@ static gboolean vorbis_play (InputPlayback * playback, const gchar * filename,
     OggVorbis_File vf;
     gint last_section = -1;
     ReplayGainInfo rg_info;
-    gfloat pcmout[PCM_BUFSIZE*sizeof(float)], **pcm;
+    gfloat * pcmout = NULL, **pcm;
     gint bytes, channels, samplerate, br;
     gchar * title = NULL;
+    SeekIndex index;
+    gboolean use_index = FALSE;
 
     seek_value = (start_time > 0) ? start_time : -1;
     stop_flag = FALSE;
@@ -316,12 +460,20 @@ static gboolean vorbis_play (InputPlayback * playback, const gchar * filename,
 
     vi = ov_info(&vf, -1);
 
-    if (vi->channels > 2)
+    if (vi->channels > 8)
         goto play_cleanup;
 
     br = vi->bitrate_nominal;
     channels = vi->channels;
     samplerate = vi->rate;
+    pcmout = g_new (gfloat, PCM_FRAMES * channels);
+
+    if (! vfs_is_streaming (file) && ov_seekable (& vf) && single_rate (& vf,
+     samplerate))
+    {
+        seek_index_load (& index, filename, file, samplerate);
+        use_index = TRUE;
+    }
 
     playback->set_params (playback, br, samplerate, channels);
 
@@ -362,7 +514,16 @@ static gboolean vorbis_play (InputPlayback * playback, const gchar * filename,
 
         if (seek_value >= 0)
         {
-            ov_time_seek (& vf, (double) seek_value / 1000);
+            gint64 start = g_get_monotonic_time ();
+            gboolean indexed = use_index && seek_with_index (& vf, & index,
+             (gint64) seek_value * samplerate / 1000);
+
+            if (! indexed)
+                ov_time_seek (& vf, (double) seek_value / 1000);
+
+            AUDDBG ("Seek to %d ms (%s) took %d us.\n", seek_value, indexed ?
+             "indexed" : "bisect", (gint) (g_get_monotonic_time () - start));
+
             playback->output->flush (seek_value);
             seek_value = -1;
         }
@@ -380,7 +541,8 @@ DRAIN:
             break;
         }
 
-        bytes = vorbis_interleave_buffer (pcm, bytes, channels, pcmout);
+        if (use_index)
+            seek_index_add (& index, ov_pcm_tell (& vf), ov_raw_tell (& vf));
 
         { /* try to detect when metadata has changed */
             vorbis_comment * comment = ov_comment (& vf, -1);
@@ -406,13 +568,14 @@ DRAIN:
              */
             vi = ov_info(&vf, -1);
 
-            if (vi->channels > 2)
+            if (vi->channels > 8)
                 goto stop_processing;
 
             if (vi->rate != samplerate || vi->channels != channels)
             {
                 samplerate = vi->rate;
                 channels = vi->channels;
+                pcmout = g_renew (gfloat, pcmout, PCM_FRAMES * channels);
 
                 if (!playback->output->open_audio(FMT_FLOAT, vi->rate, vi->channels)) {
                     error = TRUE;
@@ -425,6 +588,7 @@ DRAIN:
             }
         }
 
+        bytes = vorbis_interleave_buffer (pcm, bytes, channels, pcmout);
         playback->output->write_audio (pcmout, bytes);
 
 stop_processing:
@@ -442,7 +606,14 @@ stop_processing:
 
 play_cleanup:
 
+    if (use_index)
+    {
+        seek_index_save (& index, filename, file);
+        seek_index_free (& index);
+    }
+
     ov_clear(&vf);
+    g_free (pcmout);
     g_free (title);
     return ! error;
 }
@@ -9,4 +9,23 @@ extern ov_callbacks vorbis_callbacks;
 
 gboolean vorbis_update_song_tuple (const Tuple * tuple, VFSFile * fd);
 
+/* seekindex.c */
+typedef struct {
+    gint64 pcm;         /* absolute sample position */
+    gint64 offset;      /* byte offset of the page that follows it */
+} SeekPoint;
+
+typedef struct {
+    GArray * points;    /* sorted by pcm */
+    gint64 step;
+    gboolean changed;
+} SeekIndex;
+
+void seek_index_load (SeekIndex * index, const gchar * filename, VFSFile * file,
+ gint rate);
+void seek_index_save (SeekIndex * index, const gchar * filename, VFSFile * file);
+void seek_index_free (SeekIndex * index);
+void seek_index_add (SeekIndex * index, gint64 pcm, gint64 offset);
+gint seek_index_find (const SeekIndex * index, gint64 pcm);
+
 #endif                          /* __VORBIS_H__ */
@@ -2,16 +2,25 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <wavpack/wavpack.h>
 
 #include <audacious/audtag.h>
 #include <audacious/debug.h>
 #include <audacious/i18n.h>
+#include <audacious/misc.h>
 #include <audacious/plugin.h>
+#include <audacious/preferences.h>
 
 #include "config.h"
 
-#define BUFFER_SIZE 256 /* read buffer size, in samples / frames */
+/* Decode block length.  Hi-res files would otherwise mean thousands of unpack
+ * and write_audio calls per second. */
+#define BLOCK_MS 40
+#define MIN_BLOCK_FRAMES 256
 #define SAMPLE_SIZE(a) (a == 8 ? sizeof(uint8_t) : (a == 16 ? sizeof(uint16_t) : sizeof(uint32_t)))
 #define SAMPLE_FMT(a) (a == 8 ? FMT_S8 : (a == 16 ? FMT_S16_NE : (a == 24 ? FMT_S24_NE : FMT_S32_NE)))
 
@@ -22,6 +31,16 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static int64_t seek_value = -1;
 static bool_t stop_flag = FALSE;
 
+static const char * const wv_defaults[] = {
+ "float_output", "FALSE",
+ NULL};
+
+static bool_t wv_init (void)
+{
+    aud_config_set_defaults ("wavpack", wv_defaults);
+    return TRUE;
+}
+
 /* Audacious VFS wrappers for Wavpack stream reading
  */
 
@@ -110,6 +129,62 @@ static void wv_deattach (VFSFile * wvc_input, WavpackContext * ctx)
     WavpackCloseFile(ctx);
 }
 
+/* Narrows the unpacked samples to the output width.  The values always fit,
+ * so the saturating packs give the same result as truncation. */
+static void squeeze_samples (const int32_t * in, void * out, int count, int bits)
+{
+    int i = 0;
+
+    if (bits == 8)
+    {
+        int8_t * wp = out;
+
+#ifdef __SSE2__
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i a = _mm_packs_epi32 (_mm_loadu_si128 ((const __m128i *)
+             (in + i)), _mm_loadu_si128 ((const __m128i *) (in + i + 4)));
+            __m128i b = _mm_packs_epi32 (_mm_loadu_si128 ((const __m128i *)
+             (in + i + 8)), _mm_loadu_si128 ((const __m128i *) (in + i + 12)));
+            _mm_storeu_si128 ((__m128i *) (wp + i), _mm_packs_epi16 (a, b));
+        }
+#endif
+        for (; i < count; i ++)
+            wp[i] = in[i] & 0xff;
+    }
+    else if (bits == 16)
+    {
+        int16_t * wp = out;
+
+#ifdef __SSE2__
+        for (; i + 8 <= count; i += 8)
+            _mm_storeu_si128 ((__m128i *) (wp + i), _mm_packs_epi32
+             (_mm_loadu_si128 ((const __m128i *) (in + i)), _mm_loadu_si128
+             ((const __m128i *) (in + i + 4))));
+#endif
+        for (; i < count; i ++)
+            wp[i] = in[i] & 0xffff;
+    }
+}
+
+/* Integer samples are right-justified in the file's bytes per sample. */
+static void samples_to_float (const int32_t * in, float * out, int count,
+ int bytes)
+{
+    float scale = 1.0f / (1u << (8 * bytes - 1));
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128 vscale = _mm_set1_ps (scale);
+
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_ps (out + i, _mm_mul_ps (_mm_cvtepi32_ps (_mm_loadu_si128
+         ((const __m128i *) (in + i))), vscale));
+#endif
+    for (; i < count; i ++)
+        out[i] = in[i] * scale;
+}
+
 static bool_t wv_play (InputPlayback * playback, const char * filename,
  VFSFile * file, int start_time, int stop_time, bool_t pause)
 {
@@ -118,14 +193,17 @@ static bool_t wv_play (InputPlayback * playback, const char * filename,
 
     int32_t *input = NULL;
     void *output = NULL;
-    int sample_rate, num_channels, bits_per_sample;
+    int sample_rate, num_channels, bits_per_sample, bytes_per_sample;
+    int block_frames, mode;
     unsigned num_samples;
     WavpackContext *ctx = NULL;
     VFSFile *wvc_input = NULL;
     bool_t error = FALSE;
 
+    /* OPEN_NORMALIZE scales float files to +/-1.0, as they are passed to
+     * the output unchanged */
     if (! wv_attach (filename, file, & wvc_input, & ctx, NULL, OPEN_TAGS |
-     OPEN_WVC))
+     OPEN_WVC | OPEN_NORMALIZE))
     {
         fprintf (stderr, "Error opening Wavpack file '%s'.", filename);
         error = TRUE;
@@ -135,9 +213,28 @@ static bool_t wv_play (InputPlayback * playback, const char * filename,
     sample_rate = WavpackGetSampleRate(ctx);
     num_channels = WavpackGetNumChannels(ctx);
     bits_per_sample = WavpackGetBitsPerSample(ctx);
+    bytes_per_sample = WavpackGetBytesPerSample(ctx);
     num_samples = WavpackGetNumSamples(ctx);
-
-    if (!playback->output->open_audio(SAMPLE_FMT(bits_per_sample), sample_rate, num_channels))
+    mode = WavpackGetMode(ctx);
+
+    /* Float files are unpacked as IEEE floats already.  Lossy and hybrid
+     * files can optionally be converted to float here, so the output side
+     * does not requantize them. */
+    bool_t float_file = (mode & MODE_FLOAT) != 0;
+    bool_t to_float = ! float_file && ! (mode & MODE_LOSSLESS) && aud_get_bool
+     ("wavpack", "float_output");
+    bool_t use_float = float_file || to_float;
+
+    /* 24- and 32-bit integer and float samples go out as unpacked */
+    bool_t direct = float_file || (! to_float && SAMPLE_SIZE (bits_per_sample)
+     == sizeof (int32_t));
+
+    block_frames = (int64_t) sample_rate * BLOCK_MS / 1000;
+    if (block_frames < MIN_BLOCK_FRAMES)
+        block_frames = MIN_BLOCK_FRAMES;
+
+    if (!playback->output->open_audio(use_float ? FMT_FLOAT :
+     SAMPLE_FMT(bits_per_sample), sample_rate, num_channels))
     {
         fprintf (stderr, "Error opening audio output.");
         error = TRUE;
@@ -147,9 +244,11 @@ static bool_t wv_play (InputPlayback * playback, const char * filename,
     if (pause)
         playback->output->pause(TRUE);
 
-    input = malloc(BUFFER_SIZE * num_channels * sizeof(uint32_t));
-    output = malloc(BUFFER_SIZE * num_channels * SAMPLE_SIZE(bits_per_sample));
-    if (input == NULL || output == NULL)
+    input = malloc(block_frames * num_channels * sizeof(uint32_t));
+    if (! direct)
+        output = malloc(block_frames * num_channels * (use_float ? sizeof
+         (float) : SAMPLE_SIZE(bits_per_sample)));
+    if (input == NULL || (! direct && output == NULL))
         goto error_exit;
 
     playback->set_gain_from_playlist(playback);
@@ -187,7 +286,7 @@ static bool_t wv_play (InputPlayback * playback, const char * filename,
         /* Decode audio data */
         samples_left = num_samples - WavpackGetSampleIndex(ctx);
 
-        ret = WavpackUnpackSamples(ctx, input, BUFFER_SIZE);
+        ret = WavpackUnpackSamples(ctx, input, block_frames);
         if (samples_left == 0)
             stop_flag = TRUE;
         else if (ret < 0)
@@ -198,29 +297,20 @@ static bool_t wv_play (InputPlayback * playback, const char * filename,
         else
         {
             /* Perform audio data conversion and output */
-            unsigned i;
-            int32_t *rp = input;
-            int8_t *wp = output;
-            int16_t *wp2 = output;
-            int32_t *wp4 = output;
+            int count = ret * num_channels;
 
-            if (bits_per_sample == 8)
-            {
-                for (i = 0; i < ret * num_channels; i++, wp++, rp++)
-                    *wp = *rp & 0xff;
-            }
-            else if (bits_per_sample == 16)
+            if (direct)
+                playback->output->write_audio(input, count * sizeof(int32_t));
+            else if (to_float)
             {
-                for (i = 0; i < ret * num_channels; i++, wp2++, rp++)
-                    *wp2 = *rp & 0xffff;
+                samples_to_float(input, output, count, bytes_per_sample);
+                playback->output->write_audio(output, count * sizeof(float));
             }
-            else if (bits_per_sample == 24 || bits_per_sample == 32)
+            else
             {
-                for (i = 0; i < ret * num_channels; i++, wp4++, rp++)
-                    *wp4 = *rp;
+                squeeze_samples(input, output, count, bits_per_sample);
+                playback->output->write_audio(output, count * SAMPLE_SIZE(bits_per_sample));
             }
-
-            playback->output->write_audio(output, ret * num_channels * SAMPLE_SIZE(bits_per_sample));
         }
     }
 
@@ -338,11 +428,22 @@ static const char wv_about[] =
 
 static const char *wv_fmts[] = { "wv", NULL };
 
+static const PreferencesWidget wv_widgets[] = {
+ {WIDGET_LABEL, N_("<b>Output</b>")},
+ {WIDGET_CHK_BTN, N_("Output floating point samples for lossy files"),
+  .cfg_type = VALUE_BOOLEAN, .csect = "wavpack", .cname = "float_output"}};
+
+static const PluginPreferences wv_prefs = {
+ .widgets = wv_widgets,
+ .n_widgets = sizeof wv_widgets / sizeof wv_widgets[0]};
+
 AUD_INPUT_PLUGIN
 (
     .name = N_("WavPack Decoder"),
     .domain = PACKAGE,
     .about_text = wv_about,
+    .prefs = & wv_prefs,
+    .init = wv_init,
     .play = wv_play,
     .stop = wv_stop,
     .pause = wv_pause,